@@ -24,9 +24,19 @@
 
 #include "libentropy.h"
 
+/* Flags for e2ntropy_open_flags() */
+#define E2NTROPY_OPEN_DIRECT	0x1	/* Bypass the page cache */
+
 struct e2ntropy_ctx {
 	char *device_path;
 	ext2_filsys fs;
+	int mapped;	/* Opened with e2ntropy_mmap_io_manager */
+	int direct;	/* Opened with E2NTROPY_OPEN_DIRECT */
+
+	/* Called around every data read if set, e.g. to throttle a scan */
+	double (*io_begin)(void *arg, unsigned long long bytes);
+	void (*io_end)(void *arg, double start);
+	void *io_arg;
 };
 
 struct e2ntropy_iter {
@@ -38,6 +48,52 @@ struct e2ntropy_iter {
 	blk64_t max_blocks;
 	char *buf;
 	unsigned long long buf_len;
+
+	/* On-disk block bitmaps of the last two groups looked at */
+	char *bitmap[2];
+	dgrp_t bitmap_group[2];
+	int bitmap_valid[2];
+	int bitmap_next;
+
+	/* Run of free blocks read ahead with direct I/O */
+	char *window;
+	blk64_t window_start;
+	unsigned window_blocks;
+
+	/* Histogram of the block last returned by e2ntropy_iter_next() */
+	struct entropy_ctx block_ctx;
+};
+
+/* A regular file, with the histogram of its whole contents */
+struct e2ntropy_inode {
+	ext2_ino_t ino;
+	unsigned long long size;
+	struct entropy_ctx ctx;
+};
+
+struct e2ntropy_extent;
+
+/*
+ * Iterator over the regular files of the file system
+ *
+ * Inodes are collected in batches of at most max_inodes. The extents of
+ * a batch are sorted by physical block before they are read, so that the
+ * device is swept in a single direction. Files with inline data have no
+ * extents and are counted as soon as they are found.
+ */
+struct e2ntropy_inode_iter {
+	struct e2ntropy_ctx *ctx;
+	ext2_inode_scan scan;
+	int scan_done;
+	struct e2ntropy_inode *inodes;
+	unsigned ninodes;
+	unsigned max_inodes;
+	unsigned next;
+	struct e2ntropy_extent *extents;
+	size_t nextents;
+	size_t max_extents;
+	char *buf;
+	unsigned long long buf_len;
 };
 
 static inline unsigned int e2ntropy_iter_blocksize(struct e2ntropy_ctx *ctx)
@@ -51,13 +107,29 @@ static inline blk64_t e2ntropy_iter_block_index(struct e2ntropy_iter *iter)
 		iter->bg_offset;
 }
 
+extern io_manager e2ntropy_mmap_io_manager;
+extern errcode_t e2ntropy_mmap_io_map(io_channel channel,
+				unsigned long long block, int count,
+				const char **ptr);
+
 extern int e2ntropy_open(struct e2ntropy_ctx *ctx, const char *device_path);
+extern int e2ntropy_open_flags(struct e2ntropy_ctx *ctx,
+			const char *device_path, int open_flags);
 extern void e2ntropy_close(struct e2ntropy_ctx *ctx);
 extern int e2ntropy_iter_init(struct e2ntropy_ctx *ctx,
 			struct e2ntropy_iter *iter);
+extern void e2ntropy_iter_free(struct e2ntropy_iter *iter);
+extern void e2ntropy_iter_seek(struct e2ntropy_iter *iter,
+			unsigned long bg_index, blk64_t bg_offset);
 extern const char *entropy_iter_get_buffer(struct e2ntropy_iter *iter,
 					int *err);
 extern int e2ntropy_iter_next(struct e2ntropy_iter *iter,
 		struct entropy_batch_request *req);
+extern int e2ntropy_inode_iter_init(struct e2ntropy_ctx *ctx,
+				struct e2ntropy_inode_iter *iter,
+				unsigned max_inodes);
+extern void e2ntropy_inode_iter_free(struct e2ntropy_inode_iter *iter);
+extern int e2ntropy_inode_iter_next(struct e2ntropy_inode_iter *iter,
+				struct e2ntropy_inode **inode);
 
 #endif /*__LIBE2NTROPY_H__*/
@@ -33,15 +33,45 @@ typedef enum {
 	LIBENTROPY_ALGO_BFD,
 } libentropy_algo_t;
 
+/*
+ * Width of the symbols that the frequencies are counted over
+ *
+ * Bytes are the default, so a zero filled context is a valid byte context.
+ * Words are 16-bit little endian values, and a nibble context counts the
+ * high nibble of each byte before the low one.
+ */
+typedef enum {
+	LIBENTROPY_SYMBOL_BYTE = 0,
+	LIBENTROPY_SYMBOL_NIBBLE,
+	LIBENTROPY_SYMBOL_WORD,
+} libentropy_symbol_t;
+
+/* Number of contexts that libentropy_calculate_many() works on at once */
+#define LIBENTROPY_LANES		8
+
+/* Flags for libentropy_calculate_many() */
+#define LIBENTROPY_CALC_EXACT		0x0
+#define LIBENTROPY_CALC_FAST_LOG2	0x1
+/* Maximum absolute error of the approximated log2, in bits */
+#define LIBENTROPY_FAST_LOG2_MAX_ERROR	1.1e-9
+
 enum {
 	LIBENTROPY_STATUS_SUCCESS,
 	LIBENTROPY_STATUS_FP_ERROR,
 	LIBENTROPY_STATUS_UNKNOWN_ALGO,
+	LIBENTROPY_STATUS_NOMEM,
+	LIBENTROPY_STATUS_UNKNOWN_SYMBOL,
 };
 
 struct entropy_ctx {
 	unsigned long long ec_freq_table[256];
 	unsigned long long ec_symbol_count;
+	libentropy_symbol_t ec_symbol;
+	/* Frequencies of 16-bit symbols, ec_freq_table is unused then */
+	unsigned long long *ec_wide_table;
+	/* Leading byte of a word that was split across updates */
+	unsigned char ec_partial;
+	unsigned char ec_has_partial;
 };
 
 struct entropy_batch_request {
@@ -51,10 +81,21 @@ struct entropy_batch_request {
 	int *errors;
 };
 
+int libentropy_init_ctx(struct entropy_ctx *ctx, libentropy_symbol_t symbol);
+void libentropy_reset_ctx(struct entropy_ctx *ctx);
+void libentropy_release_ctx(struct entropy_ctx *ctx);
+unsigned libentropy_alphabet_size(libentropy_symbol_t symbol);
 void libentropy_update_ctx(struct entropy_ctx *ctx,
 			const void *buf, size_t buf_len);
+void libentropy_update_ctx_zeros(struct entropy_ctx *ctx,
+			unsigned long long len);
+int libentropy_merge_ctx(struct entropy_ctx *dst,
+			const struct entropy_ctx *src);
 libentropy_result_t libentropy_calculate(const struct entropy_ctx *ctx,
 					libentropy_algo_t algo, int *err);
+extern int libentropy_calculate_many(const struct entropy_ctx *const *ctxs,
+		size_t count, libentropy_algo_t algo, int flags,
+		libentropy_result_t *results, int *errors);
 extern struct entropy_batch_request *
 libentropy_alloc_batch_request(unsigned char count, int *err);
 extern void libentropy_free_batch_request(struct entropy_batch_request *req);
@@ -0,0 +1,121 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef  __LIBENTROPYD_H__
+#define  __LIBENTROPYD_H__
+
+#include <stdint.h>
+
+#include "libentropy.h"
+
+/*
+ * Wire protocol of entropyd
+ *
+ * A client sends fixed size requests over a stream Unix socket. A data
+ * request is followed by rq_length bytes of data. An fd request carries
+ * a file descriptor as SCM_RIGHTS ancillary data on the request itself,
+ * and the daemon reads rq_length bytes from rq_offset, or up to the end
+ * of the file if rq_length is 0.
+ *
+ * Every request gets a reply with the same rq_id. Requests can be
+ * pipelined, but as they are handed to a pool of workers, the replies
+ * may come back in any order. If the request asked for bfd, the reply is
+ * followed by rp_nbins 64-bit frequencies. All the fields are in host
+ * byte order, both ends are on the same machine after all.
+ */
+
+#define ENTROPYD_MAGIC		0x64746e65	/* "entd" */
+#define ENTROPYD_VERSION	1
+#define ENTROPYD_MAX_METRICS	8
+#define ENTROPYD_SOCKET_PATH	"/var/run/entropyd.sock"
+
+enum {
+	ENTROPYD_REQ_DATA = 1,
+	ENTROPYD_REQ_FD,
+};
+
+struct entropyd_request {
+	uint32_t rq_magic;
+	uint16_t rq_version;
+	uint16_t rq_type;
+	uint64_t rq_id;
+	uint64_t rq_offset;
+	uint64_t rq_length;
+	uint8_t rq_symbol;
+	uint8_t rq_nmetrics;
+	uint8_t rq_metrics[ENTROPYD_MAX_METRICS];
+	uint8_t rq_pad[6];
+};
+
+struct entropyd_reply {
+	uint32_t rp_magic;
+	int32_t rp_status;	/* 0 or -errno */
+	uint64_t rp_id;
+	uint64_t rp_length;	/* Number of bytes measured */
+	uint32_t rp_nbins;
+	uint8_t rp_nmetrics;
+	uint8_t rp_pad[3];
+	int32_t rp_errors[ENTROPYD_MAX_METRICS];	/* LIBENTROPY_STATUS_* */
+	double rp_values[ENTROPYD_MAX_METRICS];
+};
+
+/*
+ * Client side
+ */
+
+struct entropyd_client {
+	int fd;
+	uint64_t next_id;
+};
+
+struct entropyd_query {
+	libentropy_symbol_t symbol;
+	unsigned nmetrics;
+	libentropy_algo_t metrics[ENTROPYD_MAX_METRICS];
+};
+
+struct entropyd_result {
+	uint64_t id;
+	int status;
+	unsigned long long length;
+	unsigned nmetrics;
+	int errors[ENTROPYD_MAX_METRICS];
+	double values[ENTROPYD_MAX_METRICS];
+	/* Frequencies for bfd, NULL if it wasn't asked for */
+	uint64_t *bins;
+	unsigned nbins;
+};
+
+extern int entropyd_connect(struct entropyd_client *cl, const char *path);
+extern void entropyd_disconnect(struct entropyd_client *cl);
+extern int entropyd_send_data(struct entropyd_client *cl,
+		const struct entropyd_query *query, const void *buf,
+		size_t len, uint64_t *id);
+extern int entropyd_send_fd(struct entropyd_client *cl,
+		const struct entropyd_query *query, int fd,
+		unsigned long long offset, unsigned long long len,
+		uint64_t *id);
+extern int entropyd_recv(struct entropyd_client *cl,
+		struct entropyd_result *res);
+extern void entropyd_release_result(struct entropyd_result *res);
+extern int entropyd_query_data(struct entropyd_client *cl,
+		const struct entropyd_query *query, const void *buf,
+		size_t len, struct entropyd_result *res);
+
+#endif /*__LIBENTROPYD_H__*/
@@ -18,12 +18,17 @@
  */
 
 #include <ext2fs/ext2fs.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 
 #include "libe2ntropy.h"
 #include "libentropy.h"
 
+/* Number of blocks to read from the device at once */
+#define E2NTROPY_READ_BLOCKS	256
+
 static inline int get_device_size(char *device_path, unsigned int blocksize,
 				blk64_t *size)
 {
@@ -32,19 +37,36 @@ static inline int get_device_size(char *device_path, unsigned int blocksize,
 
 /**
  * Open an ext file system instance
+ *
+ * Images in regular files are memory mapped, block devices are read
+ * through unix_io. With E2NTROPY_OPEN_DIRECT, everything is read through
+ * unix_io with O_DIRECT, a mapping would go through the page cache.
  */
-int e2ntropy_open(struct e2ntropy_ctx *ctx, const char *device_path)
+int e2ntropy_open_flags(struct e2ntropy_ctx *ctx, const char *device_path,
+			int open_flags)
 {
 	int flags = EXT2_FLAG_64BITS | EXT2_FLAG_JOURNAL_DEV_OK;
+	io_manager manager = unix_io_manager;
+	struct stat st;
 	int err;
 
 	/* If the argument device_path is NULL, use the one from the ctx */
 	if (!device_path)
 		return -EINVAL;
 
-	err = ext2fs_open(device_path, flags, 0, 0, unix_io_manager, &ctx->fs);
+	if (open_flags & E2NTROPY_OPEN_DIRECT)
+		flags |= EXT2_FLAG_DIRECT_IO;
+	else if (!stat(device_path, &st) && S_ISREG(st.st_mode) &&
+		st.st_size)
+		manager = e2ntropy_mmap_io_manager;
+	err = ext2fs_open(device_path, flags, 0, 0, manager, &ctx->fs);
 	if (err)
 		return err;
+	ctx->mapped = (manager == e2ntropy_mmap_io_manager);
+	ctx->direct = !!(open_flags & E2NTROPY_OPEN_DIRECT);
+	ctx->io_begin = NULL;
+	ctx->io_end = NULL;
+	ctx->io_arg = NULL;
 
 	/* Store the device path in ctx */
 	ctx->device_path = strdup(device_path);
@@ -52,6 +74,30 @@ int e2ntropy_open(struct e2ntropy_ctx *ctx, const char *device_path)
 	return 0;
 }
 
+int e2ntropy_open(struct e2ntropy_ctx *ctx, const char *device_path)
+{
+	return e2ntropy_open_flags(ctx, device_path, 0);
+}
+
+/*
+ * Allocate a buffer for reads from the device
+ *
+ * Direct I/O needs buffers aligned to what the device wants, unix_io
+ * bounces the reads through one of its own otherwise.
+ */
+static void *e2ntropy_alloc_io_buf(struct e2ntropy_ctx *ctx, size_t size)
+{
+	size_t align = ctx->fs->io->align;
+	void *ptr;
+
+	if (align < sizeof(void *))
+		return malloc(size);
+	if (posix_memalign(&ptr, align, size))
+		return NULL;
+
+	return ptr;
+}
+
 void e2ntropy_close(struct e2ntropy_ctx *ctx)
 {
 	ext2fs_close(ctx->fs);
@@ -62,7 +108,6 @@ void e2ntropy_close(struct e2ntropy_ctx *ctx)
 int e2ntropy_iter_init(struct e2ntropy_ctx *ctx, struct e2ntropy_iter *iter)
 {
 	ext2_filsys fs = ctx->fs;
-	void *ret;
 	int err;
 
 	memset(iter, 0, sizeof(*iter));
@@ -76,33 +121,270 @@ int e2ntropy_iter_init(struct e2ntropy_ctx *ctx, struct e2ntropy_iter *iter)
 	if (err)
 		return err;
 
-	/* Read the block bitmaps into memory */
-	ext2fs_read_block_bitmap(fs);
+	/*
+	 * Block bitmaps are read one group at a time as the iterator gets
+	 * to them, so memory use doesn't depend on the size of the file
+	 * system. Each group's bitmap is a single block on disk.
+	 */
+	iter->bitmap[0] = e2ntropy_alloc_io_buf(ctx, 2 * fs->blocksize);
+	if (!iter->bitmap[0])
+		return -ENOMEM;
+	iter->bitmap[1] = iter->bitmap[0] + fs->blocksize;
 
 	/* Adjust the internal read buffer */
-	ret = realloc(iter->buf, fs->blocksize);
-	if (!ret) {
-		free(iter->buf);
-		iter->buf = NULL;
+	iter->buf = e2ntropy_alloc_io_buf(ctx, fs->blocksize);
+	if (!iter->buf) {
+		e2ntropy_iter_free(iter);
 		return -ENOMEM;
 	}
-	iter->buf = ret;
 	iter->buf_len = fs->blocksize;
 
+	if (ctx->direct) {
+		iter->window = e2ntropy_alloc_io_buf(ctx,
+					E2NTROPY_READ_BLOCKS * fs->blocksize);
+		if (!iter->window) {
+			e2ntropy_iter_free(iter);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void e2ntropy_iter_free(struct e2ntropy_iter *iter)
+{
+	free(iter->bitmap[0]);
+	free(iter->buf);
+	free(iter->window);
+	memset(iter, 0, sizeof(*iter));
+}
+
+/*
+ * Continue the iteration from block bg_offset of group bg_index
+ *
+ * The iterator state can be saved from bg_index and bg_offset_next, and
+ * restored with this after e2ntropy_iter_init().
+ */
+void e2ntropy_iter_seek(struct e2ntropy_iter *iter, unsigned long bg_index,
+			blk64_t bg_offset)
+{
+	iter->bg_index = bg_index;
+	iter->bg_offset_next = bg_offset;
+	iter->bg_flags = -1;
+	iter->window_blocks = 0;
+}
+
+static int iter_load_bitmap(struct e2ntropy_iter *iter, dgrp_t group,
+			const char **bitmap)
+{
+	ext2_filsys fs = iter->ctx->fs;
+	int i, err;
+
+	for (i = 0; i < 2; i++) {
+		if (iter->bitmap_valid[i] && (iter->bitmap_group[i] == group)) {
+			*bitmap = iter->bitmap[i];
+			return 0;
+		}
+	}
+
+	/* Replace the older of the two */
+	i = iter->bitmap_next;
+	iter->bitmap_next ^= 1;
+	iter->bitmap_valid[i] = 0;
+	err = io_channel_read_blk64(fs->io, ext2fs_block_bitmap_loc(fs, group),
+				1, iter->bitmap[i]);
+	if (err)
+		return err;
+	iter->bitmap_group[i] = group;
+	iter->bitmap_valid[i] = 1;
+	*bitmap = iter->bitmap[i];
+
+	/*
+	 * Have the next one on its way while this group is scanned, unless
+	 * the reads bypass the page cache that it would be read into
+	 */
+	if (!iter->ctx->direct && ((group + 1) < fs->group_desc_count))
+		io_channel_cache_readahead(fs->io,
+				ext2fs_block_bitmap_loc(fs, group + 1), 1);
+
+	return 0;
+}
+
+/*
+ * Check whether a block of a BLOCK_UNINIT group holds its metadata
+ *
+ * The bitmap of such a group is not initialized, but the group can still
+ * have a backup superblock and group descriptors, and its own bitmaps
+ * and inode table. With flex_bg, the metadata of other groups is only
+ * placed in groups that are not BLOCK_UNINIT.
+ */
+static int uninit_block_in_use(ext2_filsys fs, dgrp_t group, blk64_t block)
+{
+	blk64_t super, old_desc, new_desc, itable;
+	blk_t used_blks;
+	unsigned long old_desc_blocks;
+
+	if (ext2fs_super_and_bgd_loc2(fs, group, &super, &old_desc, &new_desc,
+				&used_blks))
+		return 1;
+	if (ext2fs_has_feature_meta_bg(fs->super))
+		old_desc_blocks = fs->super->s_first_meta_bg;
+	else
+		old_desc_blocks = fs->desc_blocks +
+			fs->super->s_reserved_gdt_blocks;
+
+	if (super && (block == super))
+		return 1;
+	if (old_desc && (block >= old_desc) &&
+		(block < old_desc + old_desc_blocks))
+		return 1;
+	if (new_desc && (block == new_desc))
+		return 1;
+	if ((block == ext2fs_block_bitmap_loc(fs, group)) ||
+		(block == ext2fs_inode_bitmap_loc(fs, group)))
+		return 1;
+	itable = ext2fs_inode_table_loc(fs, group);
+	if ((block >= itable) && (block < itable + fs->inode_blocks_per_group))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Check whether a block is in use
+ *
+ * The group of a block isn't always bg_index: with 1K blocks, the first
+ * data block is 1, and the first block of a group is the last one of the
+ * group before it. Keeping two bitmaps around covers that. On bigalloc
+ * file systems, the bitmaps track clusters rather than blocks.
+ */
+static int iter_test_block(struct e2ntropy_iter *iter, blk64_t block,
+			int *err)
+{
+	ext2_filsys fs = iter->ctx->fs;
+	const blk64_t first = fs->super->s_first_data_block;
+	const char *bitmap;
+	dgrp_t group;
+	blk64_t cluster, bit;
+
+	*err = 0;
+	/* The boot block */
+	if (block < first)
+		return 1;
+	cluster = EXT2FS_B2C(fs, block - first);
+	group = cluster / fs->super->s_clusters_per_group;
+	bit = cluster % fs->super->s_clusters_per_group;
+	if (group >= fs->group_desc_count)
+		return 1;
+
+	/*
+	 * The on-disk bitmap of a BLOCK_UNINIT group is garbage. Such
+	 * groups are skipped by the iterator, this is only reached for
+	 * the block that straddles into the next group. Everything but
+	 * the metadata of the group is free.
+	 */
+	if (ext2fs_has_group_desc_csum(fs) &&
+		(ext2fs_bg_flags(fs, group) & EXT2_BG_BLOCK_UNINIT))
+		return uninit_block_in_use(fs, group, block);
+
+	*err = iter_load_bitmap(iter, group, &bitmap);
+	if (*err)
+		return 1;
+
+	return ext2fs_test_bit(bit, bitmap);
+}
+
+/*
+ * Read count blocks of data
+ *
+ * On a mapped image, ptr is pointed into the mapping and buf is not used.
+ * Otherwise, the blocks are read into buf and ptr is pointed at it.
+ */
+static int e2ntropy_read_data(struct e2ntropy_ctx *ctx, blk64_t block,
+			int count, char *buf, const char **ptr)
+{
+	double start = 0;
+	int err;
+
+	if (ctx->io_begin)
+		start = ctx->io_begin(ctx->io_arg,
+				(unsigned long long)count * ctx->fs->blocksize);
+	if (ctx->mapped) {
+		err = e2ntropy_mmap_io_map(ctx->fs->io, block, count, ptr);
+	} else {
+		err = io_channel_read_blk64(ctx->fs->io, block, count, buf);
+		*ptr = buf;
+	}
+	if (ctx->io_end)
+		ctx->io_end(ctx->io_arg, start);
+
+	return err;
+}
+
+/*
+ * Read the run of free blocks that starts at block into the window
+ *
+ * With direct I/O, every read is a round trip to the device, so reading
+ * the free blocks one at a time is slow. The run ends at the first used
+ * block, at the end of the group or when the window is full.
+ */
+static int iter_fill_window(struct e2ntropy_iter *iter, blk64_t block)
+{
+	ext2_filsys fs = iter->ctx->fs;
+	const blk64_t group_end = (iter->bg_index + 1) *
+		(blk64_t)fs->super->s_clusters_per_group;
+	const char *ptr;
+	int count = 1;
+	int err;
+
+	/* A bitmap that fails to load ends the run, the iterator reports it */
+	while ((count < E2NTROPY_READ_BLOCKS) &&
+		(block + count < group_end) &&
+		(block + count < iter->max_blocks) &&
+		!iter_test_block(iter, block + count, &err))
+		count++;
+
+	iter->window_blocks = 0;
+	err = e2ntropy_read_data(iter->ctx, block, count, iter->window, &ptr);
+	if (err)
+		return err;
+	iter->window_start = block;
+	iter->window_blocks = count;
+
 	return 0;
 }
 
+/*
+ * Get the contents of the current block
+ *
+ * For a mapped image, this is a view of the mapping and iter->buf is not
+ * touched. With direct I/O, it is a view of the window.
+ */
 const char *entropy_iter_get_buffer(struct e2ntropy_iter *iter,
 				int *err)
 {
+	const blk64_t block = e2ntropy_iter_block_index(iter);
+	const char *ptr;
+
 	*err = 0;
 
-	if (iter->buf)
-		*err = io_channel_read_blk64(iter->ctx->fs->io,
-					e2ntropy_iter_block_index(iter),
-					1, iter->buf);
+	if (!iter->buf && !iter->ctx->mapped)
+		return NULL;
+
+	if (iter->window) {
+		if ((block < iter->window_start) ||
+			(block >= iter->window_start + iter->window_blocks)) {
+			*err = iter_fill_window(iter, block);
+			if (*err)
+				return NULL;
+		}
+		return iter->window +
+			(block - iter->window_start) * iter->ctx->fs->blocksize;
+	}
+
+	*err = e2ntropy_read_data(iter->ctx, block, 1, iter->buf, &ptr);
 
-	return iter->buf;
+	return *err ? NULL : ptr;
 }
 
 int e2ntropy_iter_next(struct e2ntropy_iter *iter,
@@ -171,21 +453,23 @@ try_next_block:
 		return -ERANGE;
 
 	/* If this block is marked as used, try the next block */
-	if (ext2fs_test_block_bitmap2(fs->block_map, block)) {
+	if (iter_test_block(iter, block, &err)) {
+		if (err)
+			return err;
 		iter->bg_offset++;
 		goto try_next_block;
 	}
 
 	if (req) {
-		struct entropy_ctx entropy_ctx;
+		const char *buf;
 
-		entropy_iter_get_buffer(iter, &err);
+		buf = entropy_iter_get_buffer(iter, &err);
 		if (err)
 			return err;
 
-		memset(&entropy_ctx, 0, sizeof(entropy_ctx));
-		libentropy_update_ctx(&entropy_ctx, iter->buf, iter->buf_len);
-		err = libentropy_batch(&entropy_ctx, req);
+		memset(&iter->block_ctx, 0, sizeof(iter->block_ctx));
+		libentropy_update_ctx(&iter->block_ctx, buf, iter->buf_len);
+		err = libentropy_batch(&iter->block_ctx, req);
 		if (err)
 			return err;
 	}
@@ -194,3 +478,367 @@ try_next_block:
 
 	return 0;
 }
+
+/*
+ * Per-file iteration
+ *
+ * The extents of a batch of inodes are collected first, then read in the
+ * order of their physical blocks, each one updating the histogram of the
+ * inode it belongs to. Since the histograms don't care about the order
+ * of the bytes, the files come out right no matter how they are laid out.
+ */
+
+struct e2ntropy_extent {
+	blk64_t pblk;
+	blk64_t len;
+	unsigned long long bytes;	/* Bytes within i_size */
+	unsigned slot;			/* Inode in the batch */
+};
+
+int e2ntropy_inode_iter_init(struct e2ntropy_ctx *ctx,
+			struct e2ntropy_inode_iter *iter,
+			unsigned max_inodes)
+{
+	ext2_filsys fs = ctx->fs;
+	unsigned i;
+	int err;
+
+	memset(iter, 0, sizeof(*iter));
+	iter->ctx = ctx;
+	if (!max_inodes)
+		return -EINVAL;
+
+	err = ext2fs_open_inode_scan(fs, 0, &iter->scan);
+	if (err)
+		return err;
+
+	iter->inodes = calloc(max_inodes, sizeof(*iter->inodes));
+	iter->buf_len = E2NTROPY_READ_BLOCKS * fs->blocksize;
+	iter->buf = e2ntropy_alloc_io_buf(ctx, iter->buf_len);
+	if (!iter->inodes || !iter->buf) {
+		e2ntropy_inode_iter_free(iter);
+		return -ENOMEM;
+	}
+	iter->max_inodes = max_inodes;
+	for (i = 0; i < max_inodes; i++)
+		libentropy_init_ctx(&iter->inodes[i].ctx,
+				LIBENTROPY_SYMBOL_BYTE);
+
+	return 0;
+}
+
+void e2ntropy_inode_iter_free(struct e2ntropy_inode_iter *iter)
+{
+	unsigned i;
+
+	if (iter->scan)
+		ext2fs_close_inode_scan(iter->scan);
+	for (i = 0; i < iter->max_inodes; i++)
+		libentropy_release_ctx(&iter->inodes[i].ctx);
+	free(iter->inodes);
+	free(iter->extents);
+	free(iter->buf);
+	memset(iter, 0, sizeof(*iter));
+}
+
+static int inode_iter_add_extent(struct e2ntropy_inode_iter *iter,
+				unsigned slot, blk64_t pblk, blk64_t lblk,
+				blk64_t len)
+{
+	const unsigned long long blocksize = iter->ctx->fs->blocksize;
+	const unsigned long long size = iter->inodes[slot].size;
+	const unsigned long long start = lblk * blocksize;
+	struct e2ntropy_extent *extent;
+	unsigned long long bytes;
+	size_t max_extents;
+	void *ret;
+
+	/* Blocks preallocated past the end of the file don't count */
+	if (start >= size)
+		return 0;
+	bytes = len * blocksize;
+	if (bytes > (size - start))
+		bytes = size - start;
+
+	if (iter->nextents == iter->max_extents) {
+		max_extents = iter->max_extents ? (iter->max_extents * 2) :
+			1024;
+		ret = realloc(iter->extents,
+			max_extents * sizeof(*iter->extents));
+		if (!ret)
+			return -ENOMEM;
+		iter->extents = ret;
+		iter->max_extents = max_extents;
+	}
+
+	extent = &iter->extents[iter->nextents++];
+	extent->pblk = pblk;
+	extent->len = (bytes + blocksize - 1) / blocksize;
+	extent->bytes = bytes;
+	extent->slot = slot;
+
+	return 0;
+}
+
+static int inode_iter_map_extents(struct e2ntropy_inode_iter *iter,
+				unsigned slot, struct ext2_inode *inode)
+{
+	ext2_extent_handle_t handle;
+	struct ext2fs_extent extent;
+	int op = EXT2_EXTENT_ROOT;
+	int err;
+
+	err = ext2fs_extent_open2(iter->ctx->fs, iter->inodes[slot].ino,
+				inode, &handle);
+	if (err)
+		return err;
+
+	while (!(err = ext2fs_extent_get(handle, op, &extent))) {
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+			continue;
+		/* Unwritten extents read as zeros, see below */
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			continue;
+		err = inode_iter_add_extent(iter, slot, extent.e_pblk,
+					extent.e_lblk, extent.e_len);
+		if (err)
+			break;
+	}
+	ext2fs_extent_free(handle);
+
+	/* Running out of extents is how the walk ends */
+	if (err == EXT2_ET_EXTENT_NO_NEXT)
+		err = 0;
+
+	return err;
+}
+
+struct map_blocks_priv {
+	struct e2ntropy_inode_iter *iter;
+	unsigned slot;
+	blk64_t pblk;
+	blk64_t lblk;
+	blk64_t len;
+	int err;
+};
+
+static int map_blocks_cb(ext2_filsys fs, blk64_t *blocknr,
+			e2_blkcnt_t blockcnt, blk64_t ref_blk,
+			int ref_offset, void *priv_data)
+{
+	struct map_blocks_priv *mb = priv_data;
+
+	/* Grow the current run as long as it is contiguous */
+	if (mb->len && (*blocknr == (mb->pblk + mb->len)) &&
+		((blk64_t)blockcnt == (mb->lblk + mb->len))) {
+		mb->len++;
+		return 0;
+	}
+
+	if (mb->len) {
+		mb->err = inode_iter_add_extent(mb->iter, mb->slot, mb->pblk,
+						mb->lblk, mb->len);
+		if (mb->err)
+			return BLOCK_ABORT;
+	}
+	mb->pblk = *blocknr;
+	mb->lblk = blockcnt;
+	mb->len = 1;
+
+	return 0;
+}
+
+/*
+ * Files without extents, as created by ext2 and ext3
+ */
+static int inode_iter_map_blocks(struct e2ntropy_inode_iter *iter,
+				unsigned slot)
+{
+	struct map_blocks_priv mb;
+	int err;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.iter = iter;
+	mb.slot = slot;
+
+	err = ext2fs_block_iterate3(iter->ctx->fs, iter->inodes[slot].ino,
+				BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY,
+				NULL, map_blocks_cb, &mb);
+	if (err)
+		return err;
+	if (mb.err)
+		return mb.err;
+
+	/* Flush the last run */
+	if (mb.len)
+		err = inode_iter_add_extent(iter, slot, mb.pblk, mb.lblk,
+					mb.len);
+
+	return err;
+}
+
+/*
+ * Files small enough to live in the inode itself, in i_block and the
+ * system.data extended attribute, are counted right away
+ */
+static int inode_iter_read_inline(struct e2ntropy_inode_iter *iter,
+				unsigned slot, struct ext2_inode *inode)
+{
+	struct e2ntropy_inode *file = &iter->inodes[slot];
+	size_t size;
+	int err;
+
+	err = ext2fs_inline_data_size(iter->ctx->fs, file->ino, &size);
+	if (err)
+		return err;
+	/* Bounded by the inode size, so it always fits */
+	if (size > iter->buf_len)
+		return -EFBIG;
+	err = ext2fs_inline_data_get(iter->ctx->fs, file->ino, inode,
+				iter->buf, &size);
+	if (err)
+		return err;
+	if (size > file->size)
+		size = file->size;
+	libentropy_update_ctx(&file->ctx, iter->buf, size);
+
+	return 0;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct e2ntropy_extent *ea = a, *eb = b;
+
+	if (ea->pblk < eb->pblk)
+		return -1;
+
+	return ea->pblk > eb->pblk;
+}
+
+/*
+ * Read the extents of the batch in a single sweep over the device
+ */
+static int inode_iter_read(struct e2ntropy_inode_iter *iter)
+{
+	ext2_filsys fs = iter->ctx->fs;
+	struct e2ntropy_extent *extent;
+	struct entropy_ctx *ctx;
+	const char *buf;
+	unsigned long long bytes, len;
+	blk64_t done, count;
+	size_t i;
+	int err;
+
+	qsort(iter->extents, iter->nextents, sizeof(*iter->extents),
+		extent_cmp);
+
+	for (i = 0; i < iter->nextents; i++) {
+		extent = &iter->extents[i];
+		bytes = extent->bytes;
+		for (done = 0; done < extent->len; done += count) {
+			count = extent->len - done;
+			if (count > E2NTROPY_READ_BLOCKS)
+				count = E2NTROPY_READ_BLOCKS;
+			err = e2ntropy_read_data(iter->ctx,
+						extent->pblk + done, count,
+						iter->buf, &buf);
+			if (err)
+				return err;
+			len = count * fs->blocksize;
+			if (len > bytes)
+				len = bytes;
+			libentropy_update_ctx(&iter->inodes[extent->slot].ctx,
+					buf, len);
+			bytes -= len;
+		}
+	}
+
+	/* Whatever isn't mapped is either a hole or unwritten, i.e. 0s */
+	for (i = 0; i < iter->ninodes; i++) {
+		ctx = &iter->inodes[i].ctx;
+		if (iter->inodes[i].size > ctx->ec_symbol_count)
+			libentropy_update_ctx_zeros(ctx, iter->inodes[i].size -
+						ctx->ec_symbol_count);
+	}
+
+	return 0;
+}
+
+/*
+ * Collect and read the next batch of inodes
+ */
+static int inode_iter_fill(struct e2ntropy_inode_iter *iter)
+{
+	ext2_filsys fs = iter->ctx->fs;
+	struct e2ntropy_inode *slot;
+	struct ext2_inode inode;
+	ext2_ino_t ino;
+	int err;
+
+	iter->ninodes = 0;
+	iter->next = 0;
+	iter->nextents = 0;
+
+	while (!iter->scan_done && (iter->ninodes < iter->max_inodes)) {
+		err = ext2fs_get_next_inode(iter->scan, &ino, &inode);
+		if (err)
+			return err;
+		if (!ino) {
+			iter->scan_done = 1;
+			break;
+		}
+
+		/*
+		 * Reserved inodes such as the resize inode and the journal
+		 * look like regular files but are not user data
+		 */
+		if (ino < EXT2_FIRST_INODE(fs->super))
+			continue;
+		/* Only regular files that are still in use */
+		if (!inode.i_links_count || !LINUX_S_ISREG(inode.i_mode))
+			continue;
+		slot = &iter->inodes[iter->ninodes];
+		slot->ino = ino;
+		slot->size = EXT2_I_SIZE(&inode);
+		libentropy_reset_ctx(&slot->ctx);
+		/* Inline data lives in the inode, not in data blocks */
+		if (inode.i_flags & EXT4_INLINE_DATA_FL)
+			err = inode_iter_read_inline(iter, iter->ninodes,
+						&inode);
+		else if (inode.i_flags & EXT4_EXTENTS_FL)
+			err = inode_iter_map_extents(iter, iter->ninodes,
+						&inode);
+		else
+			err = inode_iter_map_blocks(iter, iter->ninodes);
+		if (err)
+			return err;
+		iter->ninodes++;
+	}
+
+	return inode_iter_read(iter);
+}
+
+/*
+ * Get the next regular file
+ *
+ * Returns -ERANGE once all the inodes have been visited.
+ */
+int e2ntropy_inode_iter_next(struct e2ntropy_inode_iter *iter,
+			struct e2ntropy_inode **inode)
+{
+	int err;
+
+	if (iter->next >= iter->ninodes) {
+		if (iter->scan_done)
+			return -ERANGE;
+		err = inode_iter_fill(iter);
+		if (err)
+			return err;
+		if (!iter->ninodes)
+			return -ERANGE;
+	}
+	*inode = &iter->inodes[iter->next++];
+
+	return 0;
+}
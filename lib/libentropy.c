@@ -20,8 +20,11 @@
 #include "libentropy.h"
 #include <math.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
 
-static double shannon_entropy(const unsigned long long freq_table[256],
+static double shannon_entropy(const unsigned long long *freq_table,
+			unsigned alphabet_size,
 			unsigned long long symbol_count,
 			int *err)
 {
@@ -29,7 +32,7 @@ static double shannon_entropy(const unsigned long long freq_table[256],
 	double p, logp;
 	unsigned i;
 
-	for (i = 0; i < 256; i++) {
+	for (i = 0; i < alphabet_size; i++) {
 		/* Skip symbols with 0 frequency */
 		if (!freq_table[i])
 			continue;
@@ -52,23 +55,25 @@ static double shannon_entropy(const unsigned long long freq_table[256],
  *    Expected_i = N * probability_i
  *    |  N: symbol count
  *
- * Note that we assume uniform distribution of symbols from a source
- * alphabet of 8 bits. Therefore each symbol has a probability of 1/256.
+ * Note that we assume uniform distribution of symbols from the source
+ * alphabet. Therefore each symbol has a probability of 1/K, where K is
+ * the size of the alphabet (16, 256 or 65536).
  *
  * Using this information, we can simplify the above equation to the following:
  *    X^2 = SUM { (Observed_i)^2 } / Expected - N
- *    |  Expected: N / 256
+ *    |  Expected: N / K
  */
-static double chisq(const unsigned long long freq_table[256],
+static double chisq(const unsigned long long *freq_table,
+		unsigned alphabet_size,
 		unsigned long long symbol_count, int *err)
 {
 	const double N = (double)symbol_count;
-	const double expected = N / 256.0;
+	const double expected = N / (double)alphabet_size;
 	double sum = 0, ret;
 	unsigned i;
 
 	/* SUM { (Observed_i)^2 } */
-	for (i = 0; i < 256; i++)
+	for (i = 0; i < alphabet_size; i++)
 		sum += freq_table[i] * freq_table[i];
 	ret = sum / expected - N;
 
@@ -79,36 +84,235 @@ static double chisq(const unsigned long long freq_table[256],
 	return ret;
 }
 
-void libentropy_update_ctx(struct entropy_ctx *ctx,
-			const void *buf, size_t buf_len)
+/*
+ * Prepare a context for symbols of the given width
+ *
+ * Byte contexts need no setup beyond being zero filled, but any other
+ * width has to go through here and be released with
+ * libentropy_release_ctx().
+ */
+int libentropy_init_ctx(struct entropy_ctx *ctx, libentropy_symbol_t symbol)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	switch (symbol) {
+	case LIBENTROPY_SYMBOL_BYTE:
+	case LIBENTROPY_SYMBOL_NIBBLE:
+		break;
+	case LIBENTROPY_SYMBOL_WORD:
+		ctx->ec_wide_table = calloc(1 << 16,
+					sizeof(*ctx->ec_wide_table));
+		if (!ctx->ec_wide_table)
+			return LIBENTROPY_STATUS_NOMEM;
+		break;
+	default:
+		return LIBENTROPY_STATUS_UNKNOWN_SYMBOL;
+	}
+	ctx->ec_symbol = symbol;
+
+	return LIBENTROPY_STATUS_SUCCESS;
+}
+
+/*
+ * Clear the frequencies, keeping the symbol width
+ */
+void libentropy_reset_ctx(struct entropy_ctx *ctx)
+{
+	if (ctx->ec_wide_table)
+		memset(ctx->ec_wide_table, 0,
+			(1 << 16) * sizeof(*ctx->ec_wide_table));
+	else
+		memset(ctx->ec_freq_table, 0, sizeof(ctx->ec_freq_table));
+	ctx->ec_symbol_count = 0;
+	ctx->ec_has_partial = 0;
+}
+
+void libentropy_release_ctx(struct entropy_ctx *ctx)
+{
+	free(ctx->ec_wide_table);
+	ctx->ec_wide_table = NULL;
+}
+
+unsigned libentropy_alphabet_size(libentropy_symbol_t symbol)
+{
+	switch (symbol) {
+	case LIBENTROPY_SYMBOL_NIBBLE:
+		return 1 << 4;
+	case LIBENTROPY_SYMBOL_WORD:
+		return 1 << 16;
+	default:
+		return 1 << 8;
+	}
+}
+
+static inline unsigned long long *freq_table(struct entropy_ctx *ctx)
 {
+	return ctx->ec_wide_table ? ctx->ec_wide_table : ctx->ec_freq_table;
+}
+
+/*
+ * Update kernels, one per symbol width
+ *
+ * The width is dispatched on once per buffer, so that the inner loops
+ * are specialized at compile time and don't have to shift or mask
+ * according to a runtime width.
+ */
+static void update_bytes(struct entropy_ctx *ctx,
+			const unsigned char *buf, size_t len)
+{
+	unsigned long long *table = ctx->ec_freq_table;
 	size_t i;
 
+	for (i = 0; i < len; i++)
+		table[buf[i]]++;
+	ctx->ec_symbol_count += len;
+}
+
+static void update_nibbles(struct entropy_ctx *ctx,
+			const unsigned char *buf, size_t len)
+{
+	unsigned long long *table = ctx->ec_freq_table;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		table[buf[i] >> 4]++;
+		table[buf[i] & 0x0F]++;
+	}
+	ctx->ec_symbol_count += 2 * len;
+}
+
+static void update_words(struct entropy_ctx *ctx,
+			const unsigned char *buf, size_t len)
+{
+	unsigned long long *table = ctx->ec_wide_table;
+	size_t i, words;
+
+	/* Complete the word that the last update left hanging */
+	if (ctx->ec_has_partial) {
+		table[ctx->ec_partial | (buf[0] << 8)]++;
+		ctx->ec_symbol_count++;
+		ctx->ec_has_partial = 0;
+		buf++;
+		len--;
+	}
+
+	words = len / 2;
+	for (i = 0; i < words; i++)
+		table[buf[2 * i] | (buf[(2 * i) + 1] << 8)]++;
+	ctx->ec_symbol_count += words;
+
+	if (len & 1) {
+		ctx->ec_partial = buf[len - 1];
+		ctx->ec_has_partial = 1;
+	}
+}
+
+void libentropy_update_ctx(struct entropy_ctx *ctx,
+			const void *buf, size_t buf_len)
+{
 	if (!buf_len)
 		return;
 
-	for (i = 0; i < buf_len; i++)
-		ctx->ec_freq_table[((unsigned char*)buf)[i]]++;
-	ctx->ec_symbol_count += buf_len;
+	switch (ctx->ec_symbol) {
+	case LIBENTROPY_SYMBOL_NIBBLE:
+		update_nibbles(ctx, buf, buf_len);
+		break;
+	case LIBENTROPY_SYMBOL_WORD:
+		update_words(ctx, buf, buf_len);
+		break;
+	default:
+		update_bytes(ctx, buf, buf_len);
+	}
+}
+
+/*
+ * Account for len bytes of zeros without having them in memory
+ *
+ * This is equivalent to calling libentropy_update_ctx() on a zero filled
+ * buffer of len bytes, and is meant for holes in sparse files.
+ */
+void libentropy_update_ctx_zeros(struct entropy_ctx *ctx,
+				unsigned long long len)
+{
+	if (!len)
+		return;
+
+	switch (ctx->ec_symbol) {
+	case LIBENTROPY_SYMBOL_NIBBLE:
+		ctx->ec_freq_table[0] += 2 * len;
+		ctx->ec_symbol_count += 2 * len;
+		break;
+	case LIBENTROPY_SYMBOL_WORD:
+		if (ctx->ec_has_partial) {
+			ctx->ec_wide_table[ctx->ec_partial]++;
+			ctx->ec_symbol_count++;
+			ctx->ec_has_partial = 0;
+			len--;
+		}
+		ctx->ec_wide_table[0] += len / 2;
+		ctx->ec_symbol_count += len / 2;
+		if (len & 1) {
+			ctx->ec_partial = 0;
+			ctx->ec_has_partial = 1;
+		}
+		break;
+	default:
+		ctx->ec_freq_table[0] += len;
+		ctx->ec_symbol_count += len;
+	}
+}
+
+/*
+ * Fold the symbol frequencies of src into dst
+ *
+ * Frequency tables are additive, so the context of a concatenation of
+ * streams is the merge of the contexts of the individual streams. This
+ * lets callers process disjoint pieces of the input independently. Both
+ * contexts must have the same symbol width, -EINVAL is returned
+ * otherwise. A word left hanging at the end of src is not carried over,
+ * so pieces of a word stream should be split on even offsets.
+ */
+int libentropy_merge_ctx(struct entropy_ctx *dst,
+			const struct entropy_ctx *src)
+{
+	const unsigned long long *src_table;
+	unsigned long long *dst_table;
+	unsigned i, n;
+
+	if (src->ec_symbol != dst->ec_symbol)
+		return -EINVAL;
+
+	src_table = src->ec_wide_table ? src->ec_wide_table :
+		src->ec_freq_table;
+	dst_table = freq_table(dst);
+	n = libentropy_alphabet_size(dst->ec_symbol);
+	for (i = 0; i < n; i++)
+		dst_table[i] += src_table[i];
+	dst->ec_symbol_count += src->ec_symbol_count;
+
+	return 0;
 }
 
 libentropy_result_t libentropy_calculate(const struct entropy_ctx *ctx,
 					libentropy_algo_t algo, int *err)
 {
+	const unsigned long long *table;
+	const unsigned alphabet_size = libentropy_alphabet_size(ctx->ec_symbol);
 	libentropy_result_t result;
 
+	table = ctx->ec_wide_table ? ctx->ec_wide_table : ctx->ec_freq_table;
 	switch (algo) {
 	case LIBENTROPY_ALGO_SHANNON:
-		result.r_float = shannon_entropy(ctx->ec_freq_table,
+		result.r_float = shannon_entropy(table, alphabet_size,
 						ctx->ec_symbol_count, err);
 		break;
 	case LIBENTROPY_ALGO_CHISQ:
-		result.r_float = chisq(ctx->ec_freq_table,
+		result.r_float = chisq(table, alphabet_size,
 				ctx->ec_symbol_count, err);
 		break;
 	case LIBENTROPY_ALGO_BFD:
 		/* No work is required for this one, we already have it */
-		result.r_ptr = ctx->ec_freq_table;
+		result.r_ptr = table;
 		*err = LIBENTROPY_STATUS_SUCCESS;
 		break;
 	default:
@@ -118,6 +322,263 @@ libentropy_result_t libentropy_calculate(const struct entropy_ctx *ctx,
 	return result;
 }
 
+/*
+ * Batch finalization
+ *
+ * The contexts are processed LIBENTROPY_LANES at a time. Their frequency
+ * tables are transposed, a tile of symbols at a time, so that the same
+ * symbol of every context sits in adjacent lanes. The arithmetic on a tile
+ * is then a straight line over the lanes, which the compiler turns into
+ * SIMD instructions.
+ *
+ * In exact mode, every lane goes through the same operations in the same
+ * order as libentropy_calculate(), so the results are identical. The fast
+ * mode replaces log2() with fast_log2() below.
+ */
+#define CALC_TILE		32
+#define CALC_SQRT2		1.41421356237309504880
+#define CALC_LOG2E		1.44269504088896340736
+
+/*
+ * Approximate log2(x) for positive, normal x
+ *
+ * x is split into 2^e * m with m in [sqrt(1/2), sqrt(2)), and ln(m) comes
+ * from the series 2 * (s + s^3/3 + ... + s^9/9), where s = (m-1)/(m+1)
+ * and |s| < 0.1716. The truncated tail is below s^11 / 11 * 2 / (1 - s^2),
+ * so the absolute error stays below LIBENTROPY_FAST_LOG2_MAX_ERROR. There
+ * are no branches or table lookups, so it vectorizes.
+ */
+static inline double fast_log2(double x)
+{
+	const uint64_t mantissa_mask = (1ULL << 52) - 1;
+	/* 2^52 as a double, its mantissa holds a small integer exactly */
+	const uint64_t magic = 0x4330000000000000ULL;
+	uint64_t bits, ebits;
+	double m, e, s, s2, ln;
+
+	memcpy(&bits, &x, sizeof(bits));
+	/* Stay in floating point, int64 conversions don't vectorize well */
+	ebits = (bits >> 52) | magic;
+	memcpy(&e, &ebits, sizeof(e));
+	e -= 4503599627370496.0 + 1023.0;
+	bits = (bits & mantissa_mask) | (1023ULL << 52);
+	memcpy(&m, &bits, sizeof(m));
+
+	e += (m > CALC_SQRT2) ? 1.0 : 0.0;
+	m *= (m > CALC_SQRT2) ? 0.5 : 1.0;
+
+	s = (m - 1.0) / (m + 1.0);
+	s2 = s * s;
+	ln = s * (2.0 + s2 * (2.0 / 3.0 + s2 * (2.0 / 5.0 +
+		s2 * (2.0 / 7.0 + s2 * (2.0 / 9.0)))));
+
+	return e + ln * CALC_LOG2E;
+}
+
+#ifdef __GNUC__
+/*
+ * The same, on all the lanes at once
+ *
+ * Auto-vectorization of the scalar version depends on the floating point
+ * flags the library happens to be built with, so the vector extensions
+ * are used instead where they are available.
+ */
+typedef double calc_vec_t
+	__attribute__((vector_size(LIBENTROPY_LANES * sizeof(double))));
+typedef uint64_t calc_bits_t
+	__attribute__((vector_size(LIBENTROPY_LANES * sizeof(uint64_t))));
+
+#define CALC_ONE_BITS		0x3FF0000000000000ULL
+
+static inline void fast_log2_vec(calc_vec_t *xp)
+{
+	const uint64_t mantissa_mask = (1ULL << 52) - 1;
+	const uint64_t magic = 0x4330000000000000ULL;
+	calc_bits_t bits, big;
+	calc_vec_t m, e, s, s2, ln;
+
+	bits = (calc_bits_t)*xp;
+	e = (calc_vec_t)((bits >> 52) | magic);
+	e -= 4503599627370496.0 + 1023.0;
+	m = (calc_vec_t)((bits & mantissa_mask) | (1023ULL << 52));
+
+	/* All ones in the lanes where m has to be halved */
+	big = (calc_bits_t)(m > CALC_SQRT2);
+	e += (calc_vec_t)(big & CALC_ONE_BITS);
+	m = (calc_vec_t)((calc_bits_t)m - (big & (1ULL << 52)));
+
+	s = (m - 1.0) / (m + 1.0);
+	s2 = s * s;
+	ln = s * (2.0 + s2 * (2.0 / 3.0 + s2 * (2.0 / 5.0 +
+		s2 * (2.0 / 7.0 + s2 * (2.0 / 9.0)))));
+
+	*xp = e + ln * CALC_LOG2E;
+}
+#endif
+
+/*
+ * Accumulate -p * log2(p) of a transposed tile using fast_log2()
+ */
+static void fast_shannon_tile(const double tile[][LIBENTROPY_LANES],
+			unsigned ntile, const double n[LIBENTROPY_LANES],
+			double acc[LIBENTROPY_LANES])
+{
+#ifdef __GNUC__
+	calc_vec_t f, p, x, vr, vacc;
+	calc_bits_t nz;
+	unsigned k;
+
+	/* One more rounding, but far below the error of the logarithm */
+	memcpy(&vr, n, sizeof(vr));
+	vr = 1.0 / vr;
+	memcpy(&vacc, acc, sizeof(vacc));
+	for (k = 0; k < ntile; k++) {
+		memcpy(&f, tile[k], sizeof(f));
+		p = f * vr;
+		/* Symbols with 0 frequency add 0 * log2(1) */
+		nz = (calc_bits_t)(f != 0);
+		x = (calc_vec_t)(((calc_bits_t)p & nz) |
+				(CALC_ONE_BITS & ~nz));
+		fast_log2_vec(&x);
+		vacc -= p * x;
+	}
+	memcpy(acc, &vacc, sizeof(vacc));
+#else
+	double p, x;
+	unsigned k, l;
+
+	for (k = 0; k < ntile; k++) {
+		for (l = 0; l < LIBENTROPY_LANES; l++) {
+			p = tile[k][l] / n[l];
+			/* Symbols with 0 frequency add 0 */
+			x = (tile[k][l] != 0) ? p : 1.0;
+			acc[l] -= p * fast_log2(x);
+		}
+	}
+#endif
+}
+
+static void calculate_lanes(const struct entropy_ctx *const *ctxs,
+			unsigned nlanes, unsigned alphabet_size,
+			libentropy_algo_t algo, int flags,
+			double out[LIBENTROPY_LANES])
+{
+	double tile[CALC_TILE][LIBENTROPY_LANES];
+	double n[LIBENTROPY_LANES], acc[LIBENTROPY_LANES];
+	const unsigned long long *tables[LIBENTROPY_LANES];
+	double p;
+	unsigned i, k, l, ntile;
+
+	for (l = 0; l < LIBENTROPY_LANES; l++) {
+		/* Pad the unused lanes with the first context */
+		const struct entropy_ctx *ctx = ctxs[(l < nlanes) ? l : 0];
+
+		tables[l] = ctx->ec_wide_table ? ctx->ec_wide_table :
+			ctx->ec_freq_table;
+		n[l] = (double)ctx->ec_symbol_count;
+		acc[l] = 0;
+	}
+
+	/*
+	 * Alphabets are powers of 2, but nibbles don't fill a tile. The
+	 * branches are kept outside of the lane loops so that every one of
+	 * them is a straight line.
+	 */
+	ntile = (alphabet_size < CALC_TILE) ? alphabet_size : CALC_TILE;
+	for (i = 0; i < alphabet_size; i += ntile) {
+		/* Transpose the tile, chisq wants the integer squares */
+		if (algo == LIBENTROPY_ALGO_CHISQ) {
+			for (l = 0; l < LIBENTROPY_LANES; l++)
+				for (k = 0; k < ntile; k++)
+					tile[k][l] = (double)(tables[l][i + k] *
+							tables[l][i + k]);
+			for (k = 0; k < ntile; k++)
+				for (l = 0; l < LIBENTROPY_LANES; l++)
+					acc[l] += tile[k][l];
+			continue;
+		}
+
+		for (l = 0; l < LIBENTROPY_LANES; l++)
+			for (k = 0; k < ntile; k++)
+				/* Counts are far below 2^63, sign it for speed */
+				tile[k][l] = (double)(long long)tables[l][i + k];
+
+		if (flags & LIBENTROPY_CALC_FAST_LOG2) {
+			fast_shannon_tile(tile, ntile, n, acc);
+		} else {
+			for (k = 0; k < ntile; k++) {
+				for (l = 0; l < LIBENTROPY_LANES; l++) {
+					/* Skip symbols with 0 frequency */
+					if (tile[k][l] == 0)
+						continue;
+					p = tile[k][l] / n[l];
+					acc[l] -= p * log2(p);
+				}
+			}
+		}
+	}
+
+	for (l = 0; l < LIBENTROPY_LANES; l++) {
+		if (algo == LIBENTROPY_ALGO_CHISQ)
+			out[l] = acc[l] / (n[l] / (double)alphabet_size) - n[l];
+		else
+			out[l] = acc[l];
+	}
+}
+
+/*
+ * Calculate the same metric for count contexts at once
+ *
+ * Results and errors are stored per context, as libentropy_calculate()
+ * would return them. flags is either LIBENTROPY_CALC_EXACT, which gives
+ * the same results as libentropy_calculate(), or LIBENTROPY_CALC_FAST_LOG2,
+ * which uses an approximation of log2 for the Shannon entropy. The error
+ * of each logarithm is bounded by LIBENTROPY_FAST_LOG2_MAX_ERROR, and
+ * since the probabilities add up to 1, so is the error of the entropy.
+ */
+int libentropy_calculate_many(const struct entropy_ctx *const *ctxs,
+			size_t count, libentropy_algo_t algo, int flags,
+			libentropy_result_t *results, int *errors)
+{
+	const struct entropy_ctx *lanes[LIBENTROPY_LANES];
+	double out[LIBENTROPY_LANES];
+	unsigned nlanes, alphabet_size, l;
+	size_t i, start;
+
+	if ((algo != LIBENTROPY_ALGO_SHANNON) &&
+		(algo != LIBENTROPY_ALGO_CHISQ)) {
+		for (i = 0; i < count; i++)
+			results[i] = libentropy_calculate(ctxs[i], algo,
+							&errors[i]);
+		return 0;
+	}
+
+	for (start = 0; start < count; start += nlanes) {
+		/* Fill the lanes with contexts that share an alphabet */
+		alphabet_size = libentropy_alphabet_size(ctxs[start]->ec_symbol);
+		for (nlanes = 0; (nlanes < LIBENTROPY_LANES) &&
+			     (start + nlanes < count); nlanes++) {
+			if (libentropy_alphabet_size(
+				    ctxs[start + nlanes]->ec_symbol) !=
+				alphabet_size)
+				break;
+			lanes[nlanes] = ctxs[start + nlanes];
+		}
+
+		calculate_lanes(lanes, nlanes, alphabet_size, algo, flags,
+				out);
+
+		for (l = 0; l < nlanes; l++) {
+			results[start + l].r_float = out[l];
+			errors[start + l] = isfinite(out[l]) ?
+				LIBENTROPY_STATUS_SUCCESS :
+				LIBENTROPY_STATUS_FP_ERROR;
+		}
+	}
+
+	return 0;
+}
+
 int libentropy_batch(const struct entropy_ctx *ctx,
 		struct entropy_batch_request *req)
 {
@@ -0,0 +1,307 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client library of entropyd
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "libentropyd.h"
+
+/**
+ * Connect to the daemon listening on path
+ *
+ * If path is NULL, ENTROPYD_SOCKET_PATH is used.
+ */
+int entropyd_connect(struct entropyd_client *cl, const char *path)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	if (!path)
+		path = ENTROPYD_SOCKET_PATH;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	cl->next_id = 0;
+	cl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (cl->fd == -1)
+		return -errno;
+	if (connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err = -errno;
+		close(cl->fd);
+		cl->fd = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+void entropyd_disconnect(struct entropyd_client *cl)
+{
+	if (cl->fd != -1)
+		close(cl->fd);
+	cl->fd = -1;
+}
+
+static int send_full(int fd, struct iovec *iov, int iovcnt, int passed_fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	if (passed_fd != -1) {
+		memset(&cmsg, 0, sizeof(cmsg));
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), &passed_fd, sizeof(int));
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+	}
+
+	while (iovcnt) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* The fd went with the first byte */
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while (iovcnt && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int recv_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(fd, buf, len, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* The daemon went away in the middle of a reply */
+		if (!ret)
+			return -ECONNRESET;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int fill_request(struct entropyd_client *cl,
+			struct entropyd_request *rq,
+			const struct entropyd_query *query, uint16_t type)
+{
+	unsigned i;
+
+	if (!query->nmetrics || (query->nmetrics > ENTROPYD_MAX_METRICS))
+		return -EINVAL;
+
+	memset(rq, 0, sizeof(*rq));
+	rq->rq_magic = ENTROPYD_MAGIC;
+	rq->rq_version = ENTROPYD_VERSION;
+	rq->rq_type = type;
+	rq->rq_id = cl->next_id++;
+	rq->rq_symbol = query->symbol;
+	rq->rq_nmetrics = query->nmetrics;
+	for (i = 0; i < query->nmetrics; i++)
+		rq->rq_metrics[i] = query->metrics[i];
+
+	return 0;
+}
+
+/**
+ * Queue a request for the entropy of buf
+ *
+ * The request id is stored in id, if not NULL, to match the reply with.
+ */
+int entropyd_send_data(struct entropyd_client *cl,
+		const struct entropyd_query *query, const void *buf,
+		size_t len, uint64_t *id)
+{
+	struct entropyd_request rq;
+	struct iovec iov[2];
+	int err;
+
+	err = fill_request(cl, &rq, query, ENTROPYD_REQ_DATA);
+	if (err)
+		return err;
+	rq.rq_length = len;
+
+	iov[0].iov_base = &rq;
+	iov[0].iov_len = sizeof(rq);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	err = send_full(cl->fd, iov, len ? 2 : 1, -1);
+	if (err)
+		return err;
+
+	if (id)
+		*id = rq.rq_id;
+	return 0;
+}
+
+/**
+ * Queue a request for the entropy of a range of fd
+ *
+ * The daemon reads the data itself from its own copy of fd. A len of 0
+ * means up to the end of the file.
+ */
+int entropyd_send_fd(struct entropyd_client *cl,
+		const struct entropyd_query *query, int fd,
+		unsigned long long offset, unsigned long long len,
+		uint64_t *id)
+{
+	struct entropyd_request rq;
+	struct iovec iov;
+	int err;
+
+	err = fill_request(cl, &rq, query, ENTROPYD_REQ_FD);
+	if (err)
+		return err;
+	rq.rq_offset = offset;
+	rq.rq_length = len;
+
+	iov.iov_base = &rq;
+	iov.iov_len = sizeof(rq);
+	err = send_full(cl->fd, &iov, 1, fd);
+	if (err)
+		return err;
+
+	if (id)
+		*id = rq.rq_id;
+	return 0;
+}
+
+/**
+ * Wait for the next reply
+ *
+ * With several requests in flight, the replies are not necessarily in
+ * the order of the requests, res->id tells which one it is. The result
+ * has to be released with entropyd_release_result().
+ */
+int entropyd_recv(struct entropyd_client *cl, struct entropyd_result *res)
+{
+	struct entropyd_reply rp;
+	uint64_t *bins = NULL;
+	unsigned i;
+	int err;
+
+	memset(res, 0, sizeof(*res));
+	err = recv_full(cl->fd, &rp, sizeof(rp));
+	if (err)
+		return err;
+	if ((rp.rp_magic != ENTROPYD_MAGIC) ||
+		(rp.rp_nmetrics > ENTROPYD_MAX_METRICS) ||
+		(rp.rp_nbins > 65536))
+		return -EPROTO;
+
+	if (rp.rp_nbins) {
+		bins = malloc(rp.rp_nbins * sizeof(*bins));
+		if (!bins)
+			return -ENOMEM;
+		err = recv_full(cl->fd, bins, rp.rp_nbins * sizeof(*bins));
+		if (err) {
+			free(bins);
+			return err;
+		}
+	}
+
+	res->id = rp.rp_id;
+	res->status = rp.rp_status;
+	res->length = rp.rp_length;
+	res->nmetrics = rp.rp_nmetrics;
+	for (i = 0; i < rp.rp_nmetrics; i++) {
+		res->errors[i] = rp.rp_errors[i];
+		res->values[i] = rp.rp_values[i];
+	}
+	res->bins = bins;
+	res->nbins = rp.rp_nbins;
+
+	return 0;
+}
+
+void entropyd_release_result(struct entropyd_result *res)
+{
+	free(res->bins);
+	res->bins = NULL;
+	res->nbins = 0;
+}
+
+/**
+ * Send a request and wait for its reply
+ *
+ * Only for a client that doesn't pipeline, the first reply to come back
+ * is taken to be the one for this request.
+ */
+int entropyd_query_data(struct entropyd_client *cl,
+		const struct entropyd_query *query, const void *buf,
+		size_t len, struct entropyd_result *res)
+{
+	uint64_t id;
+	int err;
+
+	err = entropyd_send_data(cl, query, buf, len, &id);
+	if (err)
+		return err;
+	err = entropyd_recv(cl, res);
+	if (err)
+		return err;
+	if (res->id != id) {
+		entropyd_release_result(res);
+		return -EPROTO;
+	}
+
+	return 0;
+}
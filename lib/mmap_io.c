@@ -0,0 +1,289 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory mapped io_manager for file system images
+ *
+ * The whole image is mapped read-only, and reads are served by copying
+ * out of the mapping, without a syscall or a block cache in between.
+ * e2ntropy_mmap_io_map() goes one step further and hands out pointers
+ * into the mapping so that the data is not copied at all. Writes are
+ * not supported.
+ */
+
+#include <ext2fs/ext2fs.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libe2ntropy.h"
+
+struct mmap_private {
+	int fd;
+	const char *base;
+	unsigned long long size;
+	struct struct_io_stats stats;
+};
+
+static struct struct_io_manager struct_mmap_io_manager;
+
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel)
+{
+	struct mmap_private *data = NULL;
+	io_channel io = NULL;
+	struct stat st;
+	void *base;
+	errcode_t err;
+
+	if (!name)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (flags & IO_FLAG_RW)
+		return EXT2_ET_RO_FILSYS;
+
+	err = ext2fs_get_memzero(sizeof(*io), &io);
+	if (err)
+		return err;
+	err = ext2fs_get_memzero(sizeof(*data), &data);
+	if (err)
+		goto fail;
+	err = ext2fs_get_mem(strlen(name) + 1, &io->name);
+	if (err)
+		goto fail;
+	strcpy(io->name, name);
+
+	data->fd = open(name, O_RDONLY);
+	if (data->fd < 0) {
+		err = errno;
+		goto fail;
+	}
+	if (fstat(data->fd, &st) < 0) {
+		err = errno;
+		goto fail_close;
+	}
+	/* Block devices can't be sized with fstat, they get unix_io */
+	if (!S_ISREG(st.st_mode) || !st.st_size) {
+		err = EXT2_ET_UNIMPLEMENTED;
+		goto fail_close;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, data->fd, 0);
+	if (base == MAP_FAILED) {
+		err = errno;
+		goto fail_close;
+	}
+	data->base = base;
+	data->size = st.st_size;
+	data->stats.num_fields = 2;
+
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = &struct_mmap_io_manager;
+	io->block_size = 1024;
+	io->refcount = 1;
+	io->private_data = data;
+	*channel = io;
+
+	return 0;
+
+fail_close:
+	close(data->fd);
+fail:
+	if (io)
+		ext2fs_free_mem(&io->name);
+	ext2fs_free_mem(&data);
+	ext2fs_free_mem(&io);
+	return err;
+}
+
+static errcode_t mmap_close(io_channel channel)
+{
+	struct mmap_private *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	if (--channel->refcount > 0)
+		return 0;
+
+	data = channel->private_data;
+	munmap((void *)data->base, data->size);
+	close(data->fd);
+	ext2fs_free_mem(&channel->private_data);
+	ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+
+	return 0;
+}
+
+static errcode_t mmap_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	channel->block_size = blksize;
+
+	return 0;
+}
+
+/*
+ * Find the bytes of count blocks starting at block in the mapping
+ *
+ * A negative count is a size in bytes, as everywhere in libext2fs. len
+ * is set to the number of bytes that are actually in the image.
+ */
+static errcode_t mmap_locate(io_channel channel, unsigned long long block,
+			int count, const char **ptr, size_t *size,
+			size_t *len)
+{
+	struct mmap_private *data = channel->private_data;
+	unsigned long long offset;
+
+	*size = (count < 0) ? (size_t)-count :
+		((size_t)count * channel->block_size);
+	offset = block * channel->block_size;
+	if (offset >= data->size)
+		*len = 0;
+	else if (*size > (data->size - offset))
+		*len = data->size - offset;
+	else
+		*len = *size;
+	*ptr = data->base + offset;
+	data->stats.bytes_read += *len;
+
+	return (*len == *size) ? 0 : EXT2_ET_SHORT_READ;
+}
+
+static errcode_t mmap_read_blk64(io_channel channel, unsigned long long block,
+				int count, void *buf)
+{
+	const char *ptr;
+	size_t size, len;
+	errcode_t err;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	err = mmap_locate(channel, block, count, &ptr, &size, &len);
+	memcpy(buf, ptr, len);
+	/* Like unix_io, pad a short read with 0s */
+	if (err)
+		memset((char *)buf + len, 0, size - len);
+
+	return err;
+}
+
+static errcode_t mmap_read_blk(io_channel channel, unsigned long block,
+			int count, void *buf)
+{
+	return mmap_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t mmap_write_blk64(io_channel channel, unsigned long long block,
+				int count, const void *buf)
+{
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t mmap_write_blk(io_channel channel, unsigned long block,
+				int count, const void *buf)
+{
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t mmap_write_byte(io_channel channel, unsigned long offset,
+				int size, const void *buf)
+{
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t mmap_flush(io_channel channel)
+{
+	return 0;
+}
+
+static errcode_t mmap_set_option(io_channel channel, const char *option,
+				const char *arg)
+{
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t mmap_get_stats(io_channel channel, io_stats *stats)
+{
+	struct mmap_private *data = channel->private_data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	if (stats)
+		*stats = &data->stats;
+
+	return 0;
+}
+
+static errcode_t mmap_cache_readahead(io_channel channel,
+				unsigned long long block,
+				unsigned long long count)
+{
+	struct mmap_private *data = channel->private_data;
+	unsigned long long offset = block * channel->block_size;
+	unsigned long long len = count * channel->block_size;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (offset >= data->size)
+		return 0;
+	if (len > (data->size - offset))
+		len = data->size - offset;
+	/* madvise() wants a page aligned address */
+	len += offset % pagesize;
+	offset -= offset % pagesize;
+	madvise((void *)(data->base + offset), len, MADV_WILLNEED);
+
+	return 0;
+}
+
+static struct struct_io_manager struct_mmap_io_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "e2ntropy mmap I/O Manager",
+	.open		= mmap_open,
+	.close		= mmap_close,
+	.set_blksize	= mmap_set_blksize,
+	.read_blk	= mmap_read_blk,
+	.write_blk	= mmap_write_blk,
+	.flush		= mmap_flush,
+	.write_byte	= mmap_write_byte,
+	.set_option	= mmap_set_option,
+	.get_stats	= mmap_get_stats,
+	.read_blk64	= mmap_read_blk64,
+	.write_blk64	= mmap_write_blk64,
+	.cache_readahead = mmap_cache_readahead,
+};
+
+io_manager e2ntropy_mmap_io_manager = &struct_mmap_io_manager;
+
+/*
+ * Get a pointer to count blocks of the image, without copying them
+ *
+ * The channel has to be opened by e2ntropy_mmap_io_manager. The pointer
+ * stays valid until the channel is closed.
+ */
+errcode_t e2ntropy_mmap_io_map(io_channel channel, unsigned long long block,
+			int count, const char **ptr)
+{
+	size_t size, len;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	if (channel->manager != e2ntropy_mmap_io_manager)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	return mmap_locate(channel, block, count, ptr, &size, &len);
+}
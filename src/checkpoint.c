@@ -0,0 +1,199 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checkpoints of a scan in progress
+ *
+ * A checkpoint records where in the input the scan is, the context of the
+ * block that is being filled, and how much output has been written. To
+ * resume, the input is seeked to the recorded offset, the context is
+ * restored and the output is truncated to the recorded position, so that
+ * anything printed after the checkpoint is printed again exactly once.
+ *
+ * Like the index, the file is in host byte order.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "libentropy.h"
+#include "entropy.h"
+#include "checkpoint_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CHECKPOINT_MAGIC	"ENTCKPT\0"
+#define CHECKPOINT_VERSION	2
+
+struct checkpoint_header {
+	char ch_magic[8];
+	uint32_t ch_version;
+	uint32_t ch_has_partial;
+	/* Options that change the output, they have to match to resume */
+	uint32_t ch_symbol;
+	uint32_t ch_algo;
+	uint32_t ch_precision;
+	uint32_t ch_calc_flags;
+	uint32_t ch_bfd_bin_size;
+	uint32_t ch_pad;
+	uint64_t ch_blocksize;
+	uint64_t ch_skip_offset;
+	uint64_t ch_size_limit;
+	/* To tell whether it is still the same input */
+	uint64_t ch_input_ino;
+	uint64_t ch_input_size;
+	/* Position of the scan */
+	uint64_t ch_pos;
+	uint64_t ch_offset;
+	uint64_t ch_total_bytes_read;
+	uint64_t ch_remaining;
+	int64_t ch_output_pos;
+	/* Context of the block in progress, the table follows */
+	uint64_t ch_symbol_count;
+	uint32_t ch_partial;
+	uint32_t ch_reserved;
+};
+
+static void checkpoint_identify(int fd, struct checkpoint_header *hdr)
+{
+	struct stat st;
+
+	hdr->ch_input_ino = 0;
+	hdr->ch_input_size = 0;
+	if (fstat(fd, &st))
+		return;
+	hdr->ch_input_ino = st.st_ino;
+	/* Devices report a size of 0, their identity is all we have */
+	hdr->ch_input_size = S_ISREG(st.st_mode) ? (uint64_t)st.st_size :
+		(uint64_t)st.st_rdev;
+}
+
+int checkpoint_save(const struct entropy_opts *opts, int fd,
+		const struct checkpoint *ckpt, const struct entropy_ctx *ctx)
+{
+	const unsigned alphabet_size = libentropy_alphabet_size(ctx->ec_symbol);
+	const unsigned long long *table;
+	struct checkpoint_header hdr;
+	struct iovec iov[2];
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ch_magic, CHECKPOINT_MAGIC, sizeof(hdr.ch_magic));
+	hdr.ch_version = CHECKPOINT_VERSION;
+	hdr.ch_symbol = opts->symbol;
+	hdr.ch_algo = opts->algo;
+	hdr.ch_precision = opts->precision;
+	hdr.ch_calc_flags = opts->calc_flags;
+	hdr.ch_bfd_bin_size = opts->bfd_bin_size;
+	hdr.ch_blocksize = opts->blocksize;
+	hdr.ch_skip_offset = opts->skip_offset;
+	hdr.ch_size_limit = opts->size_limit;
+	checkpoint_identify(fd, &hdr);
+	hdr.ch_pos = ckpt->pos;
+	hdr.ch_offset = ckpt->offset;
+	hdr.ch_total_bytes_read = ckpt->total_bytes_read;
+	hdr.ch_remaining = ckpt->remaining;
+	hdr.ch_output_pos = ckpt->output_pos;
+	hdr.ch_symbol_count = ctx->ec_symbol_count;
+	hdr.ch_has_partial = ctx->ec_has_partial;
+	hdr.ch_partial = ctx->ec_partial;
+	table = ctx->ec_wide_table ? ctx->ec_wide_table : ctx->ec_freq_table;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)table;
+	iov[1].iov_len = alphabet_size * sizeof(*table);
+
+	return checkpoint_write(opts->checkpoint_path, iov, 2);
+}
+
+/*
+ * Restore the state of a scan from its checkpoint
+ *
+ * ctx has to be initialized for opts->symbol. Returns -ENOENT if there is
+ * no checkpoint and -ESTALE if it doesn't belong to this scan.
+ */
+int checkpoint_load(const struct entropy_opts *opts, int fd,
+		struct checkpoint *ckpt, struct entropy_ctx *ctx)
+{
+	struct checkpoint_header hdr, cur;
+	unsigned long long *table;
+	unsigned alphabet_size;
+	FILE *in;
+	int err = 0;
+
+	in = fopen(opts->checkpoint_path, "r");
+	if (!in)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	checkpoint_identify(fd, &cur);
+	if (memcmp(hdr.ch_magic, CHECKPOINT_MAGIC, sizeof(hdr.ch_magic)) ||
+		(hdr.ch_version != CHECKPOINT_VERSION)) {
+		err = -EINVAL;
+		goto out;
+	}
+	if ((hdr.ch_symbol != (uint32_t)opts->symbol) ||
+		(hdr.ch_algo != (uint32_t)opts->algo) ||
+		(hdr.ch_precision != (uint32_t)opts->precision) ||
+		(hdr.ch_calc_flags != (uint32_t)opts->calc_flags) ||
+		(hdr.ch_bfd_bin_size != opts->bfd_bin_size) ||
+		(hdr.ch_blocksize != opts->blocksize) ||
+		(hdr.ch_skip_offset != opts->skip_offset) ||
+		(hdr.ch_size_limit != opts->size_limit) ||
+		(hdr.ch_input_ino != cur.ch_input_ino) ||
+		(hdr.ch_input_size != cur.ch_input_size)) {
+		err = -ESTALE;
+		goto out;
+	}
+
+	/* The symbol matches, so the table fits in ctx */
+	alphabet_size = libentropy_alphabet_size(hdr.ch_symbol);
+	table = ctx->ec_wide_table ? ctx->ec_wide_table : ctx->ec_freq_table;
+	if (fread(table, sizeof(*table), alphabet_size, in) != alphabet_size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	ckpt->pos = hdr.ch_pos;
+	ckpt->offset = hdr.ch_offset;
+	ckpt->total_bytes_read = hdr.ch_total_bytes_read;
+	ckpt->remaining = hdr.ch_remaining;
+	ckpt->output_pos = hdr.ch_output_pos;
+	ctx->ec_symbol_count = hdr.ch_symbol_count;
+	ctx->ec_has_partial = hdr.ch_has_partial;
+	ctx->ec_partial = hdr.ch_partial;
+
+out:
+	if (err)
+		libentropy_reset_ctx(ctx);
+	fclose(in);
+	return err;
+}
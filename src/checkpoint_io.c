@@ -0,0 +1,122 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writing checkpoints and rewinding the output
+ *
+ * Checkpoints are written to a temporary file and renamed over the old
+ * one, so a crash while writing leaves the previous checkpoint intact.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "checkpoint_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+int checkpoint_write(const char *path, const struct iovec *iov, int iovcnt)
+{
+	char *tmp_path;
+	FILE *out;
+	int i, err = 0;
+
+	if (asprintf(&tmp_path, "%s.tmp", path) == -1)
+		return -ENOMEM;
+
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		err = -errno;
+		goto out;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (fwrite(iov[i].iov_base, iov[i].iov_len, 1, out) != 1) {
+			err = -errno;
+			break;
+		}
+	}
+	if (!err && (fflush(out) || fsync(fileno(out))))
+		err = -errno;
+	if (fclose(out) && !err)
+		err = -errno;
+	/* Replace the old one only once the new one is complete */
+	if (!err && rename(tmp_path, path))
+		err = -errno;
+	if (err)
+		unlink(tmp_path);
+
+out:
+	free(tmp_path);
+	return err;
+}
+
+/*
+ * Make the output durable and get its current position, or -1 if it
+ * isn't seekable
+ *
+ * This has to be called before the checkpoint is written, otherwise a
+ * crash could leave a checkpoint that points past the end of the output.
+ */
+int checkpoint_sync_output(long long *pos)
+{
+	struct stat st;
+
+	if (fflush(stdout))
+		return -errno;
+	if (!fstat(fileno(stdout), &st) && S_ISREG(st.st_mode) &&
+		fsync(fileno(stdout)))
+		return -errno;
+	*pos = ftello(stdout);
+
+	return 0;
+}
+
+/*
+ * Throw away the output printed after the checkpoint was taken
+ */
+int checkpoint_rewind_output(long long output_pos)
+{
+	struct stat st;
+
+	if (output_pos < 0) {
+		fprintf(stderr, "The output is not seekable, results printed"
+			" after the checkpoint may be repeated\n");
+		return 0;
+	}
+
+	fflush(stdout);
+	/* Truncating would pad the output with zeros instead */
+	if (!fstat(fileno(stdout), &st) && S_ISREG(st.st_mode) &&
+		(st.st_size < output_pos)) {
+		fprintf(stderr, "The output is shorter than when the"
+			" checkpoint was taken, it has to be appended to\n");
+		return -EINVAL;
+	}
+	if (ftruncate(fileno(stdout), output_pos) ||
+		fseeko(stdout, output_pos, SEEK_SET))
+		return -errno;
+
+	return 0;
+}
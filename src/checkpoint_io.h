@@ -0,0 +1,36 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef  __CHECKPOINT_IO_H__
+#define  __CHECKPOINT_IO_H__
+
+#include <sys/uio.h>
+
+/*
+ * File handling shared by the checkpoints of entropy and e2ntropy
+ *
+ * The record itself is up to each tool, these only take care of
+ * replacing the checkpoint atomically and of the output position.
+ */
+extern int checkpoint_write(const char *path, const struct iovec *iov,
+			int iovcnt);
+extern int checkpoint_sync_output(long long *pos);
+extern int checkpoint_rewind_output(long long output_pos);
+
+#endif /*__CHECKPOINT_IO_H__*/
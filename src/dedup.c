@@ -0,0 +1,345 @@
+/**
+ * Copyright 2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Block deduplication cache
+ *
+ * Blocks are identified by a 128-bit hash of their contents, and what
+ * was computed for a block is kept in a bounded LRU. Usually that is
+ * just the final result, so a block whose hash is already in the cache
+ * is neither counted nor finalized again. The frequency table is only
+ * kept when it is needed after finalization, for bfd output or to be
+ * merged into the larger levels of --levels. The hash is not
+ * cryptographic, but at 128 bits an accidental collision is not a
+ * practical concern.
+ */
+
+#include "config.h"
+#include "libentropy.h"
+#include "entropy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+struct dedup_entry {
+	struct dedup_key key;
+	struct dedup_entry *hnext;	/* Hash chain */
+	struct dedup_entry *prev;	/* Towards the most recently used */
+	struct dedup_entry *next;	/* Towards the least recently used */
+	libentropy_result_t result;
+	struct entropy_ctx ctx[];	/* Only if the cache keeps histograms */
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/*
+ * MurmurHash3 x64 128-bit variant, by Austin Appleby (public domain)
+ */
+static void dedup_hash(const void *buf, size_t len, uint64_t out[2])
+{
+	const unsigned char *data = buf;
+	const size_t nblocks = len / 16;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k1, data + (i * 16), sizeof(k1));
+		memcpy(&k2, data + (i * 16) + 8, sizeof(k2));
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	data += nblocks * 16;
+	k1 = k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t)data[14] << 48; /* fall through */
+	case 14: k2 ^= (uint64_t)data[13] << 40; /* fall through */
+	case 13: k2 ^= (uint64_t)data[12] << 32; /* fall through */
+	case 12: k2 ^= (uint64_t)data[11] << 24; /* fall through */
+	case 11: k2 ^= (uint64_t)data[10] << 16; /* fall through */
+	case 10: k2 ^= (uint64_t)data[9] << 8;   /* fall through */
+	case 9:  k2 ^= (uint64_t)data[8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		/* fall through */
+	case 8:  k1 ^= (uint64_t)data[7] << 56;  /* fall through */
+	case 7:  k1 ^= (uint64_t)data[6] << 48;  /* fall through */
+	case 6:  k1 ^= (uint64_t)data[5] << 40;  /* fall through */
+	case 5:  k1 ^= (uint64_t)data[4] << 32;  /* fall through */
+	case 4:  k1 ^= (uint64_t)data[3] << 24;  /* fall through */
+	case 3:  k1 ^= (uint64_t)data[2] << 16;  /* fall through */
+	case 2:  k1 ^= (uint64_t)data[1] << 8;   /* fall through */
+	case 1:  k1 ^= (uint64_t)data[0];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
+
+/*
+ * Set up a cache that uses at most budget bytes
+ *
+ * With histograms set, entries also keep the frequency table of the
+ * block, which makes them about 2KiB each instead of under 100 bytes.
+ */
+int dedup_init(struct dedup_cache *dc, unsigned long long budget,
+		libentropy_symbol_t symbol, libentropy_algo_t algo,
+		int histograms)
+{
+	size_t capacity, nbuckets = 1, entry_size;
+
+	memset(dc, 0, sizeof(*dc));
+	entry_size = sizeof(struct dedup_entry);
+	if (histograms)
+		entry_size += sizeof(struct entropy_ctx);
+	/* Account for the entry and its share of the bucket array */
+	capacity = budget / (entry_size + sizeof(struct dedup_entry *));
+	if (!capacity)
+		return -EINVAL;
+	while (nbuckets < capacity)
+		nbuckets <<= 1;
+
+	dc->entries = calloc(capacity, entry_size);
+	if (!dc->entries)
+		return -ENOMEM;
+	dc->buckets = calloc(nbuckets, sizeof(*dc->buckets));
+	if (!dc->buckets) {
+		free(dc->entries);
+		dc->entries = NULL;
+		return -ENOMEM;
+	}
+	dc->entry_size = entry_size;
+	dc->capacity = capacity;
+	dc->nbuckets = nbuckets;
+	dc->symbol = symbol;
+	dc->algo = algo;
+	dc->histograms = histograms;
+
+	return 0;
+}
+
+void dedup_free(struct dedup_cache *dc)
+{
+	free(dc->buckets);
+	free(dc->entries);
+	memset(dc, 0, sizeof(*dc));
+}
+
+static void dedup_lru_unlink(struct dedup_cache *dc, struct dedup_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		dc->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		dc->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void dedup_lru_push(struct dedup_cache *dc, struct dedup_entry *e)
+{
+	e->prev = NULL;
+	e->next = dc->head;
+	if (dc->head)
+		dc->head->prev = e;
+	dc->head = e;
+	if (!dc->tail)
+		dc->tail = e;
+}
+
+static struct dedup_entry **dedup_bucket(struct dedup_cache *dc,
+					const struct dedup_key *key)
+{
+	return &dc->buckets[key->hash[0] & (dc->nbuckets - 1)];
+}
+
+static int dedup_key_equal(const struct dedup_key *a,
+			const struct dedup_key *b)
+{
+	return (a->hash[0] == b->hash[0]) && (a->hash[1] == b->hash[1]) &&
+		(a->len == b->len) && (a->symbol == b->symbol) &&
+		(a->algo == b->algo);
+}
+
+static struct dedup_entry *dedup_find(struct dedup_cache *dc,
+				const struct dedup_key *key)
+{
+	struct dedup_entry *e;
+
+	for (e = *dedup_bucket(dc, key); e; e = e->hnext) {
+		if (dedup_key_equal(&e->key, key)) {
+			dedup_lru_unlink(dc, e);
+			dedup_lru_push(dc, e);
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Look up a block in the cache
+ *
+ * Returns the entry or NULL on a miss. In both cases, key is set for
+ * the block so that the caller can insert it later without rehashing.
+ */
+static struct dedup_entry *dedup_lookup(struct dedup_cache *dc,
+				const void *buf, size_t len,
+				struct dedup_key *key)
+{
+	struct dedup_entry *e;
+
+	memset(key, 0, sizeof(*key));
+	dedup_hash(buf, len, key->hash);
+	key->len = len;
+	key->symbol = dc->symbol;
+	key->algo = dc->algo;
+	dc->lookups++;
+
+	e = dedup_find(dc, key);
+	if (e)
+		dc->hits++;
+
+	return e;
+}
+
+/*
+ * Get an entry for key, reusing it if the same block was inserted
+ * in the meantime and evicting the least recently used one if full
+ */
+static struct dedup_entry *dedup_insert(struct dedup_cache *dc,
+					const struct dedup_key *key)
+{
+	struct dedup_entry *e, **pp;
+
+	e = dedup_find(dc, key);
+	if (e)
+		return e;
+
+	if (dc->used < dc->capacity) {
+		e = (struct dedup_entry *)((char *)dc->entries +
+					(dc->used++ * dc->entry_size));
+	} else {
+		/* Evict the least recently used entry */
+		e = dc->tail;
+		dedup_lru_unlink(dc, e);
+		for (pp = dedup_bucket(dc, &e->key); *pp != e;
+		     pp = &(*pp)->hnext)
+			;
+		*pp = e->hnext;
+	}
+
+	e->key = *key;
+	pp = dedup_bucket(dc, key);
+	e->hnext = *pp;
+	*pp = e;
+	dedup_lru_push(dc, e);
+
+	return e;
+}
+
+/*
+ * Look up the result of a whole block
+ *
+ * Returns 1 and sets result on a hit, 0 on a miss. Either way, key is
+ * set for dedup_insert_result().
+ */
+int dedup_lookup_result(struct dedup_cache *dc, const void *buf, size_t len,
+			struct dedup_key *key, libentropy_result_t *result)
+{
+	const struct dedup_entry *e;
+
+	e = dedup_lookup(dc, buf, len, key);
+	if (!e)
+		return 0;
+	*result = e->result;
+
+	return 1;
+}
+
+/*
+ * Remember the result of a block
+ *
+ * Pointer results refer to the context they were calculated from, so
+ * a cache without histograms can only hold the numeric ones.
+ */
+void dedup_insert_result(struct dedup_cache *dc, const struct dedup_key *key,
+			libentropy_result_t result)
+{
+	struct dedup_entry *e;
+
+	e = dedup_insert(dc, key);
+	e->result = result;
+}
+
+/*
+ * Update ctx with a whole block, reusing the cached histogram if possible
+ *
+ * Only for a cache set up with histograms.
+ */
+void dedup_update_ctx(struct dedup_cache *dc, struct entropy_ctx *ctx,
+		const void *buf, size_t len)
+{
+	struct dedup_entry *e;
+	struct dedup_key key;
+
+	e = dedup_lookup(dc, buf, len, &key);
+	if (!e) {
+		e = dedup_insert(dc, &key);
+		memset(e->ctx, 0, sizeof(e->ctx[0]));
+		libentropy_update_ctx(e->ctx, buf, len);
+	}
+	libentropy_merge_ctx(ctx, e->ctx);
+}
+
+void dedup_report(const struct dedup_cache *dc)
+{
+	fprintf(stderr, "Dedup cache: %llu lookups, %llu hits (%.2f%%),"
+		" %zu/%zu entries\n", dc->lookups, dc->hits,
+		dc->lookups ? (100.0 * dc->hits / dc->lookups) : 0.0,
+		dc->used, dc->capacity);
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Direct I/O
+ *
+ * Reads with O_DIRECT bypass the page cache, so a scan of a whole device
+ * doesn't push everybody else's data out of it. The buffer, the offset
+ * and the length of such reads all have to be aligned. A reader keeps an
+ * aligned window of the file and serves the reads of arbitrary ranges
+ * out of it, refilling it with one large aligned read when a range falls
+ * outside. The heads and tails that -s and -l cut into blocks are only
+ * ever seen as part of a window.
+ *
+ * The windows come from a small pool, so that going through many files
+ * doesn't allocate and free a buffer for each.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "entropy.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Number of idle windows kept in the pool */
+#define DIRECT_POOL_SIZE	16
+
+static struct {
+	pthread_mutex_t lock;
+	void *bufs[DIRECT_POOL_SIZE];
+	unsigned count;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *direct_buf_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.count)
+		buf = pool.bufs[--pool.count];
+	pthread_mutex_unlock(&pool.lock);
+
+	if (!buf && posix_memalign(&buf, DIRECT_ALIGN, DIRECT_WINDOW_SIZE))
+		return NULL;
+
+	return buf;
+}
+
+static void direct_buf_put(void *buf)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (pool.count < DIRECT_POOL_SIZE) {
+		pool.bufs[pool.count++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	free(buf);
+}
+
+/*
+ * Switch fd to direct I/O and set up a reader for it
+ *
+ * Fails with -EINVAL if the file system doesn't support O_DIRECT.
+ */
+int direct_init(struct direct_reader *dr, int fd, struct throttle *throttle)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if ((flags == -1) || (fcntl(fd, F_SETFL, flags | O_DIRECT) == -1))
+		return -errno;
+
+	dr->buf = direct_buf_get();
+	if (!dr->buf)
+		return -ENOMEM;
+	dr->fd = fd;
+	dr->throttle = throttle;
+	dr->start = 0;
+	dr->len = 0;
+
+	return 0;
+}
+
+void direct_release(struct direct_reader *dr)
+{
+	if (dr->buf)
+		direct_buf_put(dr->buf);
+	dr->buf = NULL;
+}
+
+/*
+ * Get up to len bytes of the file at offset
+ *
+ * data is pointed at the bytes in the window, which stay valid until the
+ * next call. Returns the number of bytes available, which may be less
+ * than len, 0 at EOF and -errno on error.
+ */
+ssize_t direct_read(struct direct_reader *dr, unsigned long long offset,
+		size_t len, const char **data)
+{
+	unsigned long long start;
+	ssize_t bytes_read;
+	double begin;
+
+	if ((offset < dr->start) || (offset >= dr->start + dr->len)) {
+		start = offset & ~((unsigned long long)DIRECT_ALIGN - 1);
+		begin = throttle_begin(dr->throttle, DIRECT_WINDOW_SIZE);
+		do {
+			bytes_read = pread(dr->fd, dr->buf,
+					DIRECT_WINDOW_SIZE, start);
+		} while ((bytes_read == -1) && (errno == EINTR));
+		throttle_end(dr->throttle, begin);
+		if (bytes_read == -1) {
+			dr->len = 0;
+			return -errno;
+		}
+		dr->start = start;
+		dr->len = bytes_read;
+		/* The file ends before offset */
+		if (offset >= dr->start + dr->len)
+			return 0;
+	}
+
+	*data = dr->buf + (offset - dr->start);
+	if (len > dr->start + dr->len - offset)
+		len = dr->start + dr->len - offset;
+
+	return len;
+}
@@ -19,90 +19,712 @@
 
 #include "libentropy.h"
 #include "libe2ntropy.h"
+#include "throttle.h"
+#include "checkpoint_io.h"
 
 #include <ext2fs/ext2fs.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CHECKPOINT_MAGIC	"E2NCKPT\0"
+#define CHECKPOINT_VERSION	2
+
+struct e2ntropy_opts {
+	const char *device_path;
+	double entropy_min;
+	double chisq_max;
+
+	/* Options specific to the per-file mode */
+	int files;
+	int paths;
+	unsigned max_inodes;
+
+	/* Options specific to the range output */
+	int ranges;
+	int range_blocks;
+
+	/* Options specific to checkpointing */
+	const char *checkpoint_path;
+	unsigned long long checkpoint_interval;
+	int resume;
+
+	/* Options specific to throttling */
+	unsigned long long max_bandwidth;
+	unsigned long long max_iops;
+	unsigned long long target_latency;
+
+	/* Bypass the page cache */
+	int direct;
+};
+
+/*
+ * Run of adjacent free blocks that passed the filters
+ *
+ * The histograms of the blocks are merged as the run grows, so the
+ * chisq of a range is that of its data as a whole.
+ */
+struct block_range {
+	unsigned long long start;
+	unsigned long long len;		/* 0 if no range is open */
+	double entropy_min;
+	double entropy_sum;
+	double entropy_max;
+	struct entropy_ctx ctx;
+};
+
+/*
+ * Iterator state of a free block scan
+ *
+ * Like with entropy --checkpoint, the position in the output is recorded
+ * too, and a resumed scan truncates the output back to it. The range
+ * that is open at the time is saved along with it.
+ */
+struct checkpoint {
+	char ck_magic[8];
+	uint32_t ck_version;
+	uint32_t ck_blocksize;
+	uint8_t ck_uuid[16];
+	double ck_entropy_min;
+	double ck_chisq_max;
+	uint64_t ck_bg_index;
+	uint64_t ck_bg_offset;
+	int64_t ck_output_pos;
+	uint32_t ck_ranges;
+	uint32_t ck_blocks;
+	uint64_t ck_range_start;
+	uint64_t ck_range_len;
+	double ck_range_entropy_min;
+	double ck_range_entropy_sum;
+	double ck_range_entropy_max;
+	uint64_t ck_range_freq_table[256];
+	uint64_t ck_range_symbol_count;
+};
+
+/* A file that passed the filters, waiting for its path to be found */
+struct file_report {
+	ext2_ino_t ino;
+	unsigned long long size;
+	double entropy;
+	double chisq;
+	int printed;
+};
+
+struct path_walk {
+	ext2_filsys fs;
+	struct file_report *reports;
+	size_t nreports;
+	char path[4096];
+	size_t path_len;
+	int err;
+};
 
 static void usage(const char *pname)
 {
-	fprintf(stderr, "Usage: %s <device path>\n", pname);
+	fprintf(stderr, "Usage: %s [-f [-p] [-n inodes[=1024]]] [-R [-a]]"
+		" [-c checkpoint [-i blocks[=262144]] [-r]]"
+		" [-B bytes/s] [-I iops] [-L usec] [-D] <device path>"
+		" [min entropy] [max chisq]\n"
+		"\t-f: Report the entropy of every regular file instead of"
+		" the free blocks\n"
+		"\t-p: Print paths instead of inode numbers\n"
+		"\t-n: Number of inodes whose extents are read in one sweep\n"
+		"\t-R: Print runs of adjacent free blocks that pass the"
+		" filters as <start>, <length>, <min entropy>,"
+		" <mean entropy>, <max entropy>, <chisq>\n"
+		"\t-a: Print the blocks of the runs too\n"
+		"\t-c: Save the progress of a free block scan to checkpoint"
+		" every -i free blocks\n"
+		"\t-r: Continue from the checkpoint, the output must be"
+		" appended to\n"
+		"\t-B, -I: Limit the reads to bytes/s and reads/s\n"
+		"\t-L: Back off from the limits while the read latency"
+		" is above usec\n"
+		"\t-D: Read with O_DIRECT, bypassing the page cache\n",
+		pname);
 	exit(-1);
 }
 
-int main(int argc, char *argv[])
+static unsigned long long parse_number(const char *str, const char *what,
+					const char *pname)
 {
-	struct e2ntropy_ctx e2ctx;
-	struct e2ntropy_iter e2iter;
-	struct entropy_batch_request *req = NULL;
-	char *device_path;
-	unsigned long i;
-	blk64_t block;
-	double entropy, chisq;
-	double entropy_min = - 1, chisq_max = -1;
-	int err;
+	unsigned long long val;
+	char *tmp;
+
+	val = strtoull(str, &tmp, 0);
+	if ((str[0] == '\0') || (*tmp != '\0') || !val) {
+		fprintf(stderr, "Invalid %s (%s)\n", what, str);
+		usage(pname);
+	}
 
-	if ((argc < 2) || (argc > 4))
+	return val;
+}
+
+static int parse_args(int argc, char * const argv[],
+		struct e2ntropy_opts *opts)
+{
+	char *tmp;
+	int c;
+
+	opts->entropy_min = -1;
+	opts->chisq_max = -1;
+	opts->files = 0;
+	opts->paths = 0;
+	opts->max_inodes = 1024;
+	opts->ranges = 0;
+	opts->range_blocks = 0;
+	opts->checkpoint_path = NULL;
+	opts->checkpoint_interval = 1 << 18;
+	opts->resume = 0;
+	opts->max_bandwidth = 0;
+	opts->max_iops = 0;
+	opts->target_latency = 0;
+	opts->direct = 0;
+
+	while ((c = getopt(argc, argv, "B:DI:L:Rc:afhi:n:pr")) != -1) {
+		switch (c) {
+		case 'B':
+			opts->max_bandwidth = parse_number(optarg, "bandwidth",
+							argv[0]);
+			break;
+		case 'D':
+			opts->direct = 1;
+			break;
+		case 'I':
+			opts->max_iops = parse_number(optarg, "IOPS", argv[0]);
+			break;
+		case 'L':
+			opts->target_latency = parse_number(optarg,
+							"target latency",
+							argv[0]);
+			break;
+		case 'R':
+			opts->ranges = 1;
+			break;
+		case 'a':
+			opts->range_blocks = 1;
+			break;
+		case 'c':
+			opts->checkpoint_path = optarg;
+			break;
+		case 'i':
+			opts->checkpoint_interval = strtoull(optarg, &tmp, 0);
+			if ((optarg[0] == '\0') || (*tmp != '\0') ||
+				!opts->checkpoint_interval) {
+				fprintf(stderr, "Invalid checkpoint interval"
+					" (%s)\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'f':
+			opts->files = 1;
+			break;
+		case 'n':
+			opts->max_inodes = strtoul(optarg, &tmp, 0);
+			if ((optarg[0] == '\0') || (*tmp != '\0') ||
+				!opts->max_inodes) {
+				fprintf(stderr, "Invalid number of inodes"
+					" (%s)\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'p':
+			opts->paths = 1;
+			break;
+		case 'r':
+			opts->resume = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if ((optind >= argc) || ((argc - optind) > 3))
+		usage(argv[0]);
+	if (opts->paths && !opts->files)
+		usage(argv[0]);
+	if ((opts->range_blocks && !opts->ranges) ||
+		(opts->ranges && opts->files))
+		usage(argv[0]);
+	if ((opts->resume && !opts->checkpoint_path) ||
+		(opts->checkpoint_path && opts->files))
+		usage(argv[0]);
+	if (opts->target_latency && !opts->max_bandwidth && !opts->max_iops)
 		usage(argv[0]);
-	device_path = argv[1];
-	if (argc > 2) {
-		entropy_min = atof(argv[2]);
-		if ((entropy_min < 0) || (entropy_min > 8.0)) {
+
+	opts->device_path = argv[optind++];
+	if (optind < argc) {
+		opts->entropy_min = atof(argv[optind++]);
+		if ((opts->entropy_min < 0) || (opts->entropy_min > 8.0)) {
 			fprintf(stderr, "Invalid minimum entropy: %f\n",
-				entropy_min);
+				opts->entropy_min);
 			return -1;
 		}
 	}
-	if (argc > 3) {
-		chisq_max = atof(argv[3]);
-		if (chisq_max < 0)
+	if (optind < argc) {
+		opts->chisq_max = atof(argv[optind++]);
+		if (opts->chisq_max < 0) {
 			fprintf(stderr, "Invalid maximum chisq: %f\n",
-				chisq_max);
+				opts->chisq_max);
 			return -1;
+		}
 	}
 
-	/* Open the file system */
-	err = e2ntropy_open(&e2ctx, device_path);
-	if (err) {
-		fprintf(stderr, "Unable to open device: ", device_path);
+	return 0;
+}
+
+static int skip_result(const struct e2ntropy_opts *opts, double entropy,
+		double chisq)
+{
+	if ((opts->entropy_min > 0) && (entropy < opts->entropy_min))
+		return 1;
+	if ((opts->chisq_max > 0) && (chisq > opts->chisq_max))
+		return 1;
+
+	return 0;
+}
+
+static void checkpoint_fill(struct checkpoint *ckpt,
+			const struct e2ntropy_opts *opts,
+			const struct e2ntropy_ctx *e2ctx)
+{
+	memset(ckpt, 0, sizeof(*ckpt));
+	memcpy(ckpt->ck_magic, CHECKPOINT_MAGIC, sizeof(ckpt->ck_magic));
+	ckpt->ck_version = CHECKPOINT_VERSION;
+	ckpt->ck_blocksize = e2ctx->fs->blocksize;
+	memcpy(ckpt->ck_uuid, e2ctx->fs->super->s_uuid,
+		sizeof(ckpt->ck_uuid));
+	ckpt->ck_entropy_min = opts->entropy_min;
+	ckpt->ck_chisq_max = opts->chisq_max;
+	ckpt->ck_ranges = opts->ranges;
+	ckpt->ck_blocks = opts->range_blocks;
+}
+
+static int checkpoint_save(const struct e2ntropy_opts *opts,
+			const struct e2ntropy_ctx *e2ctx,
+			const struct e2ntropy_iter *e2iter,
+			const struct block_range *range)
+{
+	struct checkpoint ckpt;
+	struct iovec iov;
+	long long output_pos;
+	unsigned i;
+	int err;
+
+	checkpoint_fill(&ckpt, opts, e2ctx);
+	ckpt.ck_bg_index = e2iter->bg_index;
+	ckpt.ck_bg_offset = e2iter->bg_offset_next;
+	ckpt.ck_range_start = range->start;
+	ckpt.ck_range_len = range->len;
+	ckpt.ck_range_entropy_min = range->entropy_min;
+	ckpt.ck_range_entropy_sum = range->entropy_sum;
+	ckpt.ck_range_entropy_max = range->entropy_max;
+	for (i = 0; i < 256; i++)
+		ckpt.ck_range_freq_table[i] = range->ctx.ec_freq_table[i];
+	ckpt.ck_range_symbol_count = range->ctx.ec_symbol_count;
+	err = checkpoint_sync_output(&output_pos);
+	if (err)
+		return err;
+	ckpt.ck_output_pos = output_pos;
+
+	iov.iov_base = &ckpt;
+	iov.iov_len = sizeof(ckpt);
+
+	return checkpoint_write(opts->checkpoint_path, &iov, 1);
+}
+
+static int checkpoint_resume(const struct e2ntropy_opts *opts,
+			const struct e2ntropy_ctx *e2ctx,
+			struct e2ntropy_iter *e2iter,
+			struct block_range *range)
+{
+	struct checkpoint ckpt, cur;
+	FILE *in;
+	unsigned i;
+	int err = 0;
+
+	in = fopen(opts->checkpoint_path, "r");
+	if (!in)
+		return -errno;
+	if (fread(&ckpt, sizeof(ckpt), 1, in) != 1)
+		err = -EINVAL;
+	fclose(in);
+	if (err)
 		return err;
+
+	checkpoint_fill(&cur, opts, e2ctx);
+	if (memcmp(ckpt.ck_magic, cur.ck_magic, sizeof(ckpt.ck_magic)) ||
+		(ckpt.ck_version != cur.ck_version))
+		return -EINVAL;
+	if ((ckpt.ck_blocksize != cur.ck_blocksize) ||
+		memcmp(ckpt.ck_uuid, cur.ck_uuid, sizeof(ckpt.ck_uuid)) ||
+		(ckpt.ck_entropy_min != cur.ck_entropy_min) ||
+		(ckpt.ck_chisq_max != cur.ck_chisq_max) ||
+		(ckpt.ck_ranges != cur.ck_ranges) ||
+		(ckpt.ck_blocks != cur.ck_blocks))
+		return -ESTALE;
+
+	/* Throw away what was printed after the checkpoint */
+	err = checkpoint_rewind_output(ckpt.ck_output_pos);
+	if (err)
+		return err;
+
+	e2ntropy_iter_seek(e2iter, ckpt.ck_bg_index, ckpt.ck_bg_offset);
+	range->start = ckpt.ck_range_start;
+	range->len = ckpt.ck_range_len;
+	range->entropy_min = ckpt.ck_range_entropy_min;
+	range->entropy_sum = ckpt.ck_range_entropy_sum;
+	range->entropy_max = ckpt.ck_range_entropy_max;
+	for (i = 0; i < 256; i++)
+		range->ctx.ec_freq_table[i] = ckpt.ck_range_freq_table[i];
+	range->ctx.ec_symbol_count = ckpt.ck_range_symbol_count;
+
+	return 0;
+}
+
+static void range_print(struct block_range *range)
+{
+	libentropy_result_t chisq;
+	int err;
+
+	if (!range->len)
+		return;
+
+	chisq = libentropy_calculate(&range->ctx, LIBENTROPY_ALGO_CHISQ,
+				&err);
+	if (err == LIBENTROPY_STATUS_SUCCESS)
+		fprintf(stdout, "%llu, %llu, %f, %f, %f, %f\n", range->start,
+			range->len, range->entropy_min,
+			range->entropy_sum / range->len, range->entropy_max,
+			chisq.r_float);
+
+	range->len = 0;
+	libentropy_reset_ctx(&range->ctx);
+}
+
+/*
+ * Add a block to the open range, or start a new one if it isn't adjacent
+ */
+static void range_add(struct block_range *range, unsigned long long block,
+		const struct entropy_ctx *ctx, double entropy)
+{
+	if (range->len && (block != range->start + range->len))
+		range_print(range);
+
+	if (!range->len) {
+		range->start = block;
+		range->entropy_min = range->entropy_max = entropy;
+		range->entropy_sum = 0;
 	}
+	if (entropy < range->entropy_min)
+		range->entropy_min = entropy;
+	if (entropy > range->entropy_max)
+		range->entropy_max = entropy;
+	range->entropy_sum += entropy;
+	range->len++;
+	libentropy_merge_ctx(&range->ctx, ctx);
+}
+
+static int scan_free_blocks(struct e2ntropy_ctx *e2ctx,
+			struct entropy_batch_request *req,
+			const struct e2ntropy_opts *opts)
+{
+	struct e2ntropy_iter e2iter;
+	struct block_range range;
+	unsigned long long visited = 0, block;
+	double entropy, chisq;
+	int err;
+
+	memset(&range, 0, sizeof(range));
 
 	/* Init the iterator */
-	err = e2ntropy_iter_init(&e2ctx, &e2iter);
+	err = e2ntropy_iter_init(e2ctx, &e2iter);
 	if (err) {
 		fprintf(stderr, "%s():%d: e2ntropy_iter_init() failed\n",
 			__func__, __LINE__);
-		goto out;
+		return err;
 	}
 
-	req = libentropy_alloc_batch_request(2, &err);
-	if (!req) {
-		fprintf(stderr, "%s():%d: libentropy_alloc_batch_request()"
-			" failed\n", __func__, __LINE__);
-		goto out;
+	if (opts->checkpoint_path) {
+		if (opts->resume)
+			err = checkpoint_resume(opts, e2ctx, &e2iter, &range);
+		else
+			/* The first one records where the output starts */
+			err = checkpoint_save(opts, e2ctx, &e2iter, &range);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to %s checkpoint %s:"
+				" %s\n", __func__, __LINE__,
+				opts->resume ? "resume from" : "save",
+				opts->checkpoint_path,
+				(err == -ESTALE) ? "it is for a different scan" :
+				strerror(-err));
+			goto out;
+		}
 	}
-	req->algos[0] = LIBENTROPY_ALGO_SHANNON;
-	req->algos[1] = LIBENTROPY_ALGO_CHISQ;
 
 	while (!(err = e2ntropy_iter_next(&e2iter, req))) {
 		entropy = req->results[0].r_float;
 		chisq = req->results[1].r_float;
+		block = e2ntropy_iter_block_index(&e2iter);
 
-		if ((entropy_min > 0) &&
-			(entropy < entropy_min))
+		if (!skip_result(opts, entropy, chisq)) {
+			if (!opts->ranges || opts->range_blocks)
+				fprintf(stdout, "%llu, %f, %f\n", block,
+					entropy, chisq);
+			if (opts->ranges)
+				range_add(&range, block, &e2iter.block_ctx,
+					entropy);
+		}
+
+		if (opts->checkpoint_path &&
+			!(++visited % opts->checkpoint_interval)) {
+			err = checkpoint_save(opts, e2ctx, &e2iter, &range);
+			if (err) {
+				fprintf(stderr, "%s():%d: Unable to save"
+					" checkpoint: %s\n", __func__,
+					__LINE__, strerror(-err));
+				goto out;
+			}
+		}
+	}
+
+	/* The scan is complete, there is nothing left to resume */
+	if (err == -ERANGE) {
+		range_print(&range);
+		if (opts->checkpoint_path)
+			unlink(opts->checkpoint_path);
+	}
+
+out:
+	e2ntropy_iter_free(&e2iter);
+	return err;
+}
+
+static int report_cmp(const void *a, const void *b)
+{
+	const struct file_report *ra = a, *rb = b;
+
+	if (ra->ino < rb->ino)
+		return -1;
+
+	return ra->ino > rb->ino;
+}
+
+static int walk_dir(struct path_walk *pw, ext2_ino_t dir);
+
+static int walk_dir_cb(ext2_ino_t dir, int entry,
+		struct ext2_dir_entry *dirent, int offset, int blocksize,
+		char *buf, void *priv_data)
+{
+	struct path_walk *pw = priv_data;
+	struct file_report key, *report;
+	const int name_len = ext2fs_dirent_name_len(dirent);
+	const size_t path_len = pw->path_len;
+	int is_dir;
+
+	if (!dirent->inode)
+		return 0;
+	if (((name_len == 1) && (dirent->name[0] == '.')) ||
+		((name_len == 2) && !strncmp(dirent->name, "..", 2)))
+		return 0;
+	/* Paths that don't fit are skipped rather than truncated */
+	if ((path_len + 1 + name_len) >= sizeof(pw->path))
+		return 0;
+
+	pw->path[path_len] = '/';
+	memcpy(&pw->path[path_len + 1], dirent->name, name_len);
+	pw->path[path_len + 1 + name_len] = '\0';
+
+	key.ino = dirent->inode;
+	report = bsearch(&key, pw->reports, pw->nreports,
+			sizeof(*pw->reports), report_cmp);
+	if (report && !report->printed) {
+		fprintf(stdout, "%s, %llu, %f, %f\n", pw->path,
+			report->size, report->entropy, report->chisq);
+		report->printed = 1;
+	}
+
+	/* Fall back to the inode if the file type isn't recorded */
+	if (ext2fs_dirent_file_type(dirent))
+		is_dir = (ext2fs_dirent_file_type(dirent) == EXT2_FT_DIR);
+	else
+		is_dir = !report &&
+			!ext2fs_check_directory(pw->fs, dirent->inode);
+	if (is_dir) {
+		pw->path_len = path_len + 1 + name_len;
+		pw->err = walk_dir(pw, dirent->inode);
+		pw->path_len = path_len;
+	}
+	pw->path[path_len] = '\0';
+
+	return pw->err ? DIRENT_ABORT : 0;
+}
+
+static int walk_dir(struct path_walk *pw, ext2_ino_t dir)
+{
+	int err;
+
+	err = ext2fs_dir_iterate2(pw->fs, dir, 0, NULL, walk_dir_cb, pw);
+	if (err)
+		return err;
+
+	return pw->err;
+}
+
+/*
+ * Print the files that passed the filters by path
+ *
+ * Inodes don't know their names, so the directory tree is walked once
+ * at the end, looking up every entry among the reported inodes. Files
+ * with several hard links are printed under the first path found.
+ */
+static int print_paths(struct e2ntropy_ctx *e2ctx,
+		struct file_report *reports, size_t nreports)
+{
+	struct path_walk pw;
+
+	memset(&pw, 0, sizeof(pw));
+	pw.fs = e2ctx->fs;
+	pw.reports = reports;
+	pw.nreports = nreports;
+
+	qsort(reports, nreports, sizeof(*reports), report_cmp);
+
+	return walk_dir(&pw, EXT2_ROOT_INO);
+}
+
+static int scan_files(struct e2ntropy_ctx *e2ctx,
+		struct entropy_batch_request *req,
+		const struct e2ntropy_opts *opts)
+{
+	struct e2ntropy_inode_iter e2iter;
+	struct e2ntropy_inode *inode;
+	struct file_report *reports = NULL;
+	size_t nreports = 0, max_reports = 0;
+	double entropy, chisq;
+	void *ret;
+	int err;
+
+	err = e2ntropy_inode_iter_init(e2ctx, &e2iter, opts->max_inodes);
+	if (err) {
+		fprintf(stderr, "%s():%d: e2ntropy_inode_iter_init()"
+			" failed\n", __func__, __LINE__);
+		return err;
+	}
+
+	while (!(err = e2ntropy_inode_iter_next(&e2iter, &inode))) {
+		err = libentropy_batch(&inode->ctx, req);
+		if (err)
+			break;
+		entropy = req->results[0].r_float;
+		chisq = req->results[1].r_float;
+
+		if (skip_result(opts, entropy, chisq))
 			continue;
-		if ((chisq_max > 0) &&
-			(chisq > chisq_max))
+
+		if (!opts->paths) {
+			fprintf(stdout, "%u, %llu, %f, %f\n", inode->ino,
+				inode->size, entropy, chisq);
 			continue;
+		}
+
+		if (nreports == max_reports) {
+			max_reports = max_reports ? (max_reports * 2) : 1024;
+			ret = realloc(reports,
+				max_reports * sizeof(*reports));
+			if (!ret) {
+				err = -ENOMEM;
+				break;
+			}
+			reports = ret;
+		}
+		reports[nreports].ino = inode->ino;
+		reports[nreports].size = inode->size;
+		reports[nreports].entropy = entropy;
+		reports[nreports].chisq = chisq;
+		reports[nreports].printed = 0;
+		nreports++;
+	}
+	e2ntropy_inode_iter_free(&e2iter);
+
+	if ((err == -ERANGE) && opts->paths)
+		err = print_paths(e2ctx, reports, nreports);
+	free(reports);
+
+	return err;
+}
+
+static double throttle_io_begin(void *arg, unsigned long long bytes)
+{
+	return throttle_begin(arg, bytes);
+}
+
+static void throttle_io_end(void *arg, double start)
+{
+	throttle_end(arg, start);
+}
 
-		fprintf(stdout, "%llu, %f, %f\n",
-			block = e2ntropy_iter_block_index(&e2iter),
-			entropy, chisq);
+int main(int argc, char *argv[])
+{
+	struct e2ntropy_ctx e2ctx;
+	struct e2ntropy_opts opts;
+	struct entropy_batch_request *req = NULL;
+	struct throttle throttle;
+	int throttled;
+	int err;
+
+	if (parse_args(argc, argv, &opts))
+		return -1;
+
+	/* Open the file system */
+	err = e2ntropy_open_flags(&e2ctx, opts.device_path,
+				opts.direct ? E2NTROPY_OPEN_DIRECT : 0);
+	if (err) {
+		fprintf(stderr, "Unable to open device: %s\n",
+			opts.device_path);
+		return err;
 	}
 
+	throttled = opts.max_bandwidth || opts.max_iops;
+	if (throttled) {
+		err = throttle_init(&throttle, opts.max_bandwidth,
+				opts.max_iops, opts.target_latency);
+		if (err) {
+			fprintf(stderr, "%s():%d: throttle_init() failed\n",
+				__func__, __LINE__);
+			e2ntropy_close(&e2ctx);
+			return err;
+		}
+		e2ctx.io_begin = throttle_io_begin;
+		e2ctx.io_end = throttle_io_end;
+		e2ctx.io_arg = &throttle;
+	}
+
+	req = libentropy_alloc_batch_request(2, &err);
+	if (!req) {
+		fprintf(stderr, "%s():%d: libentropy_alloc_batch_request()"
+			" failed\n", __func__, __LINE__);
+		goto out;
+	}
+	req->algos[0] = LIBENTROPY_ALGO_SHANNON;
+	req->algos[1] = LIBENTROPY_ALGO_CHISQ;
+
+	if (opts.files)
+		err = scan_files(&e2ctx, req, &opts);
+	else
+		err = scan_free_blocks(&e2ctx, req, &opts);
+	/* Running out of blocks or inodes is the normal way to finish */
+	if (err == -ERANGE)
+		err = 0;
+
 out:
 	libentropy_free_batch_request(req);
 	e2ntropy_close(&e2ctx);
+	if (throttled)
+		throttle_destroy(&throttle);
 	return err;
 }
@@ -22,6 +22,8 @@
 #include "config.h"
 #include "libentropy.h"
 #include "entropy.h"
+#include "throttle.h"
+#include "checkpoint_io.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,8 +42,38 @@ extern int opting, opterr, optopt;
 static void usage(const char *pname) {
 	fprintf(stdout, "Usage: %s [-b blocksize] [-h] [-l size limit]"
 		" [-s skip offset] [-m metric] [--precision[=6]]"
-		" [--bfd-bin-size size[=1]] [filename]\n"
-		"\tMetrics: entropy[default], chisq, bfd\n", pname);
+		" [--bfd-bin-size size[=1]] [-r] [-j threads]"
+		" [--split-size size[=64M]] [--levels size,size,...]"
+		" [--build-index index [--granule size[=64K]]]"
+		" [--index index] [--dedup-cache size]"
+		" [--symbol-width bits[=8]] [--fast-log]"
+		" [--checkpoint file [--checkpoint-interval size[=1G]]"
+		" [--resume]] [--max-bandwidth size] [--max-iops count]"
+		" [--target-latency usec] [--direct] [filename...]\n"
+		"\tMetrics: entropy[default], chisq, bfd\n"
+		"\tSymbol widths: 4, 8[default], 16\n"
+		"\t-r: Recursively scan directories and print a summary"
+		" per file\n"
+		"\t--levels: Print the blocks of every given block size,"
+		" each a multiple of the previous, in a single pass\n"
+		"\t--build-index: Store cumulative histograms of the file"
+		" in index\n"
+		"\t--index: Use index to answer the query given by -s and"
+		" -l\n"
+		"\t--dedup-cache: Reuse the results of identical blocks,"
+		" keeping at most size bytes of them\n"
+		"\t--fast-log: Approximate log2 for the entropy of the"
+		" blocks, within 1.1e-9 bits\n"
+		"\t--checkpoint: Save the progress to file every interval"
+		" bytes\n"
+		"\t--resume: Continue from the checkpoint, the output must be"
+		" appended to\n"
+		"\t--max-bandwidth, --max-iops: Limit the reads to size"
+		" bytes or count reads per second\n"
+		"\t--target-latency: Lower the limits while reads take"
+		" longer than usec on average\n"
+		"\t--direct: Read with O_DIRECT, bypassing the page cache\n",
+		pname);
 	exit(-1);
 }
 
@@ -68,6 +100,50 @@ static unsigned long long parse_ull(const char *str, int *err)
 	return ret;
 }
 
+/*
+ * Parse a size with an optional binary suffix (K, M, G or T)
+ */
+unsigned long long parse_size(const char *str, int *err)
+{
+	unsigned long long ret;
+	char *tmp;
+	unsigned shift = 0;
+
+	*err = 0;
+	ret = strtoull(str, &tmp, 0);
+	if ((str[0] == '\0') || (tmp == str)) {
+		*err = -EINVAL;
+		return 0;
+	}
+	switch (*tmp) {
+	case 'T': case 't':
+		shift += 10;
+		/* fall through */
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		tmp++;
+		break;
+	default:
+		break;
+	}
+	if (*tmp != '\0') {
+		*err = -EINVAL;
+		return 0;
+	}
+	if (shift && (ret > (ULLONG_MAX >> shift))) {
+		*err = -ERANGE;
+		return 0;
+	}
+
+	return ret << shift;
+}
+
 static libentropy_algo_t parse_metric(const char *str, int *err)
 {
 	*err = 0;
@@ -83,6 +159,20 @@ static libentropy_algo_t parse_metric(const char *str, int *err)
 	return LIBENTROPY_ALGO_SHANNON;
 }
 
+static libentropy_symbol_t parse_symbol_width(const char *str, int *err)
+{
+	*err = 0;
+	if (strcmp(str, "4") == 0)
+		return LIBENTROPY_SYMBOL_NIBBLE;
+	else if (strcmp(str, "8") == 0)
+		return LIBENTROPY_SYMBOL_BYTE;
+	else if (strcmp(str, "16") == 0)
+		return LIBENTROPY_SYMBOL_WORD;
+	else
+		*err = -1;
+	return LIBENTROPY_SYMBOL_BYTE;
+}
+
 static void set_default_opts(struct entropy_opts *opts)
 {
 	opts->blocksize = 0;
@@ -90,19 +180,59 @@ static void set_default_opts(struct entropy_opts *opts)
 	opts->skip_offset = 0;
 	opts->precision = 6;
 	opts->algo = LIBENTROPY_ALGO_SHANNON;
+	opts->symbol = LIBENTROPY_SYMBOL_BYTE;
+	opts->calc_flags = LIBENTROPY_CALC_EXACT;
 
 	opts->bfd_bin_size = 1;
+
+	opts->recursive = 0;
+	opts->threads = 0;
+	opts->split_size = 64ULL << 20;
+
+	opts->nlevels = 0;
+
+	opts->index_mode = ENTROPY_INDEX_NONE;
+	opts->index_path = NULL;
+	opts->granule = 0;
+
+	opts->dedup_budget = 0;
+	opts->dedup = NULL;
+
+	opts->checkpoint_path = NULL;
+	opts->checkpoint_interval = 1ULL << 30;
+	opts->resume = 0;
+
+	opts->max_bandwidth = 0;
+	opts->max_iops = 0;
+	opts->target_latency = 0;
+	opts->throttle = NULL;
+
+	opts->direct = 0;
 }
 
 static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 {
 	int c, err = 0;
 	int option_index;
-	unsigned i, j;
 
 	enum {
 		LONG_OPT_BFD_BIN_SIZE = 256,
 		LONG_OPT_PRECISION,
+		LONG_OPT_SPLIT_SIZE,
+		LONG_OPT_LEVELS,
+		LONG_OPT_BUILD_INDEX,
+		LONG_OPT_INDEX,
+		LONG_OPT_GRANULE,
+		LONG_OPT_DEDUP_CACHE,
+		LONG_OPT_SYMBOL_WIDTH,
+		LONG_OPT_FAST_LOG,
+		LONG_OPT_CHECKPOINT,
+		LONG_OPT_CHECKPOINT_INTERVAL,
+		LONG_OPT_RESUME,
+		LONG_OPT_MAX_BANDWIDTH,
+		LONG_OPT_MAX_IOPS,
+		LONG_OPT_TARGET_LATENCY,
+		LONG_OPT_DIRECT,
 	};
 	const struct option long_options[] = {
 		{
@@ -117,6 +247,96 @@ static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 			.flag = 0,
 			.val = LONG_OPT_PRECISION,
 		},
+		{
+			.name = "split-size",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_SPLIT_SIZE,
+		},
+		{
+			.name = "levels",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_LEVELS,
+		},
+		{
+			.name = "build-index",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_BUILD_INDEX,
+		},
+		{
+			.name = "index",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_INDEX,
+		},
+		{
+			.name = "granule",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_GRANULE,
+		},
+		{
+			.name = "dedup-cache",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_DEDUP_CACHE,
+		},
+		{
+			.name = "symbol-width",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_SYMBOL_WIDTH,
+		},
+		{
+			.name = "fast-log",
+			.has_arg = no_argument,
+			.flag = 0,
+			.val = LONG_OPT_FAST_LOG,
+		},
+		{
+			.name = "checkpoint",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_CHECKPOINT,
+		},
+		{
+			.name = "checkpoint-interval",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_CHECKPOINT_INTERVAL,
+		},
+		{
+			.name = "resume",
+			.has_arg = no_argument,
+			.flag = 0,
+			.val = LONG_OPT_RESUME,
+		},
+		{
+			.name = "max-bandwidth",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_MAX_BANDWIDTH,
+		},
+		{
+			.name = "max-iops",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_MAX_IOPS,
+		},
+		{
+			.name = "target-latency",
+			.has_arg = required_argument,
+			.flag = 0,
+			.val = LONG_OPT_TARGET_LATENCY,
+		},
+		{
+			.name = "direct",
+			.has_arg = no_argument,
+			.flag = 0,
+			.val = LONG_OPT_DIRECT,
+		},
 		{ 0, 0, 0, 0, },
 	};
 
@@ -124,7 +344,7 @@ static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 		return -1;
 	set_default_opts(opts);
 
-	while ((c = getopt_long(argc, argv, "b:hl:m:s:", long_options,
+	while ((c = getopt_long(argc, argv, "b:hj:l:m:rs:", long_options,
 						&option_index)) != -1) {
 		switch (c) {
 		case 'b':
@@ -135,6 +355,14 @@ static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 				usage(argv[0]);
 			}
 			break;
+		case 'j':
+			opts->threads = (unsigned)parse_ull(optarg, &err);
+			if (err || !opts->threads) {
+				fprintf(stderr, "Invalid thread count (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
 		case 'l':
 			opts->size_limit = parse_ull(optarg, &err);
 			if (err) {
@@ -152,6 +380,9 @@ static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 				usage(argv[0]);
 			}
 			break;
+		case 'r':
+			opts->recursive = 1;
+			break;
 		case 's':
 			opts->skip_offset = parse_ull(optarg, &err);
 			if (err) {
@@ -173,55 +404,252 @@ static int parse_args(int argc, char * const argv[], struct entropy_opts *opts)
 				usage(argv[0]);
 			}
 			break;
+		case LONG_OPT_SPLIT_SIZE:
+			opts->split_size = parse_size(optarg, &err);
+			if (err || !opts->split_size) {
+				fprintf(stderr, "Invalid split size (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_LEVELS:
+			err = pyramid_parse_levels(optarg, opts);
+			if (err) {
+				fprintf(stderr, "Invalid levels (%s): each"
+					" block size must be a multiple of the"
+					" previous one\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_BUILD_INDEX:
+			opts->index_mode = ENTROPY_INDEX_BUILD;
+			opts->index_path = optarg;
+			break;
+		case LONG_OPT_INDEX:
+			opts->index_mode = ENTROPY_INDEX_QUERY;
+			opts->index_path = optarg;
+			break;
+		case LONG_OPT_GRANULE:
+			opts->granule = parse_size(optarg, &err);
+			if (err || !opts->granule) {
+				fprintf(stderr, "Invalid granule (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_DEDUP_CACHE:
+			opts->dedup_budget = parse_size(optarg, &err);
+			if (err || !opts->dedup_budget) {
+				fprintf(stderr, "Invalid dedup cache size"
+					" (%s)\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_SYMBOL_WIDTH:
+			opts->symbol = parse_symbol_width(optarg, &err);
+			if (err) {
+				fprintf(stderr, "Invalid symbol width (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_FAST_LOG:
+			opts->calc_flags = LIBENTROPY_CALC_FAST_LOG2;
+			break;
+		case LONG_OPT_CHECKPOINT:
+			opts->checkpoint_path = optarg;
+			break;
+		case LONG_OPT_CHECKPOINT_INTERVAL:
+			opts->checkpoint_interval = parse_size(optarg, &err);
+			if (err || !opts->checkpoint_interval) {
+				fprintf(stderr, "Invalid checkpoint interval"
+					" (%s)\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_RESUME:
+			opts->resume = 1;
+			break;
+		case LONG_OPT_MAX_BANDWIDTH:
+			opts->max_bandwidth = parse_size(optarg, &err);
+			if (err || !opts->max_bandwidth) {
+				fprintf(stderr, "Invalid bandwidth (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_MAX_IOPS:
+			opts->max_iops = parse_ull(optarg, &err);
+			if (err || !opts->max_iops) {
+				fprintf(stderr, "Invalid IOPS (%s)\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_TARGET_LATENCY:
+			opts->target_latency = parse_ull(optarg, &err);
+			if (err || !opts->target_latency) {
+				fprintf(stderr, "Invalid target latency"
+					" (%s)\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case LONG_OPT_DIRECT:
+			opts->direct = 1;
+			break;
 		case 'h':
 		default:
 			usage(argv[0]);
 		};
 	}
 
+	/*
+	 * Files are opened lazily by the caller, one at a time, so that
+	 * a long list of files does not run into the fd limit. A NULL
+	 * path list means that we read from stdin.
+	 */
 	if ((optind == argc) ||
 		((optind < argc) && (!strncmp(argv[optind], "-", 1)))) {
 		opts->file_count = 1;
-		opts->fds = calloc(opts->file_count, sizeof(*opts->fds));
-		opts->fds[0] = STDIN_FILENO;
+		opts->paths = NULL;
 	} else {
 		opts->file_count = argc - optind;
-		opts->fds = calloc(opts->file_count, sizeof(*opts->fds));
-		if (!opts->fds) {
-			err = errno;
-			perror("Unable to allocate mem for fds");
-			return err;
+		opts->paths = &argv[optind];
+	}
+
+	if (opts->nlevels) {
+		if (opts->blocksize) {
+			fprintf(stderr, "Levels and blocksize are mutually"
+				" exclusive\n");
+			usage(argv[0]);
 		}
+		/* The smallest level is the one we actually read */
+		opts->blocksize = opts->levels[0];
+	}
 
-		for (i = 0; i < opts->file_count; i++)
-		{
-			opts->fds[i] = open(argv[optind++], O_RDONLY);
-			if (opts->fds[i] == -1) {
-				fprintf(stderr, "%s():%d: Unable to open file"
-					" %s: %s\n", __func__, __LINE__,
-					argv[optind - 1], strerror(err));
-				err = errno;
-				for (j = 0; j < i; j++)
-					close(opts->fds[j]);
-				free(opts->fds);
-				return err;
-			}
+	if (opts->dedup_budget &&
+		(!opts->blocksize || opts->index_mode != ENTROPY_INDEX_NONE)) {
+		fprintf(stderr, "The dedup cache requires block output\n");
+		usage(argv[0]);
+	}
+
+	if ((opts->calc_flags != LIBENTROPY_CALC_EXACT) &&
+		(!opts->blocksize || opts->nlevels)) {
+		fprintf(stderr, "The fast log2 is only used for block"
+			" output\n");
+		usage(argv[0]);
+	}
+
+	if ((opts->symbol != LIBENTROPY_SYMBOL_BYTE) &&
+		(opts->dedup_budget ||
+		 (opts->index_mode != ENTROPY_INDEX_NONE))) {
+		fprintf(stderr, "The dedup cache and the index only support"
+			" 8-bit symbols\n");
+		usage(argv[0]);
+	}
+
+	if ((opts->symbol == LIBENTROPY_SYMBOL_WORD) &&
+		(opts->split_size & 1)) {
+		fprintf(stderr, "The split size must be even for 16-bit"
+			" symbols\n");
+		usage(argv[0]);
+	}
+
+	if (opts->granule && (opts->index_mode != ENTROPY_INDEX_BUILD)) {
+		fprintf(stderr, "The granule is only used when building an"
+			" index\n");
+		usage(argv[0]);
+	}
+	if (!opts->granule)
+		opts->granule = 64ULL << 10;
+
+	if (opts->index_mode != ENTROPY_INDEX_NONE) {
+		if (opts->direct) {
+			fprintf(stderr, "The index is read through the page"
+				" cache\n");
+			usage(argv[0]);
+		}
+		if (opts->blocksize || opts->recursive ||
+			(opts->file_count > 1)) {
+			fprintf(stderr, "Index mode works on a single file"
+				" and without block output\n");
+			usage(argv[0]);
+		}
+		if ((opts->index_mode == ENTROPY_INDEX_BUILD) &&
+			(opts->skip_offset || opts->size_limit)) {
+			fprintf(stderr, "The index always covers the whole"
+				" file\n");
+			usage(argv[0]);
+		}
+		if ((opts->index_mode == ENTROPY_INDEX_QUERY) &&
+			!opts->paths) {
+			fprintf(stderr, "Querying an index requires a file,"
+				" not stdin\n");
+			usage(argv[0]);
+		}
+	}
+
+	if (opts->target_latency && !opts->max_bandwidth &&
+		!opts->max_iops) {
+		fprintf(stderr, "The target latency scales the bandwidth or"
+			" IOPS limit, one is required\n");
+		usage(argv[0]);
+	}
+
+	if (opts->resume && !opts->checkpoint_path) {
+		fprintf(stderr, "Resuming requires a checkpoint\n");
+		usage(argv[0]);
+	}
+
+	if (opts->checkpoint_path &&
+		(!opts->paths || (opts->file_count != 1) || opts->recursive ||
+		 opts->nlevels || (opts->index_mode != ENTROPY_INDEX_NONE))) {
+		fprintf(stderr, "Checkpoints work on a single file, without"
+			" levels or an index\n");
+		usage(argv[0]);
+	}
+
+	if (opts->recursive) {
+		if (!opts->paths) {
+			fprintf(stderr, "Recursive mode requires at least"
+				" one path\n");
+			usage(argv[0]);
+		}
+		if (opts->blocksize) {
+			fprintf(stderr, "Recursive mode does not support"
+				" block output\n");
+			usage(argv[0]);
 		}
 	}
 
 	return err;
 }
 
-static int print_result(const libentropy_result_t result,
-			libentropy_algo_t algo, unsigned long long offset,
-			int offset_flag, int precision,
-			unsigned char bfd_bin_size)
+/*
+ * Print a single result
+ *
+ * If tag is non-NULL, the line is prefixed with it, e.g. the path of the
+ * file or the block size of a level. The output stream is
+ * locked for the duration of the line so that results printed by
+ * concurrent scanner threads do not interleave.
+ */
+int print_result(const libentropy_result_t result,
+		const struct entropy_opts *opts, const char *tag,
+		unsigned long long offset, int offset_flag)
 {
+	const libentropy_algo_t algo = opts->algo;
+	const int precision = opts->precision;
+	const unsigned char bfd_bin_size = opts->bfd_bin_size;
+	const unsigned nbins = libentropy_alphabet_size(opts->symbol);
 	const unsigned long long *bfd;
 	unsigned long long sum;
 	unsigned i, j;
 	int err = 0;
 
+	flockfile(stdout);
+	if (tag)
+		fprintf(stdout, "%s%s", tag,
+			(algo == LIBENTROPY_ALGO_BFD) ? "," : ", ");
 	switch (algo) {
 	case LIBENTROPY_ALGO_SHANNON:
 	case LIBENTROPY_ALGO_CHISQ:
@@ -235,7 +663,7 @@ static int print_result(const libentropy_result_t result,
 		bfd = result.r_ptr;
 		if (offset_flag)
 			fprintf(stdout, "%llu,", offset);
-		for (i = 0; i < (256 - bfd_bin_size); i += bfd_bin_size) {
+		for (i = 0; (i + bfd_bin_size) < nbins; i += bfd_bin_size) {
 			sum = 0;
 			for (j = 0; j < bfd_bin_size; j++)
 				sum += bfd[i + j];
@@ -243,37 +671,258 @@ static int print_result(const libentropy_result_t result,
 		}
 		/* Handle the last iteration outside the loop */
 		sum = 0;
-		for (j = 0; j < (256 - i); j++)
+		for (j = 0; j < (nbins - i); j++)
 			sum += bfd[i + j];
 		fprintf(stdout, "%llu\n", sum);
 		break;
 	default:
 		err = -1;
 	};
+	funlockfile(stdout);
 
 	return err;
 }
 
-static int process_file(int fd, unsigned long long blocksize,
-			unsigned long long size_limit,
-			unsigned long long skip_offset,
-			libentropy_algo_t algo,
-			int precision,
-			unsigned char bfd_bin_size)
+/*
+ * Blocks whose results are calculated together
+ *
+ * In block mode, the contexts of completed blocks are queued up and
+ * finalized LIBENTROPY_LANES at a time by libentropy_calculate_many().
+ * Blocks found in the dedup cache are queued with their result, and
+ * the results of the ones that were not are added to it.
+ */
+struct block_batch {
+	struct entropy_ctx ctx[LIBENTROPY_LANES];
+	unsigned long long offset[LIBENTROPY_LANES];
+	libentropy_result_t result[LIBENTROPY_LANES];
+	struct dedup_key key[LIBENTROPY_LANES];
+	unsigned char cached[LIBENTROPY_LANES];	/* result is already known */
+	unsigned char keyed[LIBENTROPY_LANES];	/* result goes in the cache */
+	unsigned count;
+	unsigned ninit;
+};
+
+static void batch_release(struct block_batch *bb)
+{
+	unsigned i;
+
+	for (i = 0; i < bb->ninit; i++)
+		libentropy_release_ctx(&bb->ctx[i]);
+	bb->ninit = bb->count = 0;
+}
+
+static int batch_init(struct block_batch *bb, libentropy_symbol_t symbol)
+{
+	int err;
+
+	bb->count = bb->ninit = 0;
+	for (; bb->ninit < LIBENTROPY_LANES; bb->ninit++) {
+		err = libentropy_init_ctx(&bb->ctx[bb->ninit], symbol);
+		if (err) {
+			batch_release(bb);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Print the queued blocks, in order
+ */
+static int batch_flush(struct block_batch *bb, const struct entropy_opts *opts)
+{
+	const struct entropy_ctx *ctxs[LIBENTROPY_LANES];
+	libentropy_result_t results[LIBENTROPY_LANES];
+	int errors[LIBENTROPY_LANES];
+	unsigned lane[LIBENTROPY_LANES];
+	unsigned i, n = 0, count = bb->count;
+
+	/* Only the blocks that missed the cache are calculated */
+	for (i = 0; i < count; i++) {
+		if (bb->cached[i])
+			continue;
+		ctxs[n] = &bb->ctx[i];
+		lane[n++] = i;
+	}
+	for (i = n; i < LIBENTROPY_LANES; i++)
+		ctxs[i] = &bb->ctx[i];
+	if (n)
+		libentropy_calculate_many(ctxs, n, opts->algo,
+					opts->calc_flags, results, errors);
+
+	bb->count = 0;
+	for (i = 0; i < n; i++) {
+		if (errors[i] != LIBENTROPY_STATUS_SUCCESS) {
+			fprintf(stderr, "%s():%d: %s: %d\n", __func__,
+				__LINE__, "Entropy calculation failed",
+				errors[i]);
+			return -1;
+		}
+		bb->result[lane[i]] = results[i];
+		if (bb->keyed[lane[i]])
+			dedup_insert_result(opts->dedup, &bb->key[lane[i]],
+					results[i]);
+	}
+	for (i = 0; i < count; i++) {
+		print_result(bb->result[i], opts, NULL, bb->offset[i], 1);
+		if (!bb->cached[i])
+			libentropy_reset_ctx(&bb->ctx[i]);
+	}
+
+	return 0;
+}
+
+static int batch_next(struct block_batch *bb, unsigned long long offset,
+		const struct entropy_opts *opts)
+{
+	bb->offset[bb->count++] = offset;
+
+	if (bb->count < LIBENTROPY_LANES)
+		return 0;
+
+	return batch_flush(bb, opts);
+}
+
+/*
+ * Queue the completed block in ctx, leaving ctx empty for the next one
+ */
+static int batch_push(struct block_batch *bb, struct entropy_ctx *ctx,
+		unsigned long long offset, const struct entropy_opts *opts)
+{
+	struct entropy_ctx tmp;
+
+	/* Swap rather than copy, both stay initialized and empty */
+	tmp = bb->ctx[bb->count];
+	bb->ctx[bb->count] = *ctx;
+	*ctx = tmp;
+	bb->cached[bb->count] = bb->keyed[bb->count] = 0;
+
+	return batch_next(bb, offset, opts);
+}
+
+/*
+ * Queue a completed block that was collected in full, looking up its
+ * result in the dedup cache and counting it only on a miss
+ */
+static int batch_push_block(struct block_batch *bb, const void *block,
+		size_t len, unsigned long long offset,
+		const struct entropy_opts *opts)
+{
+	const unsigned i = bb->count;
+
+	if (dedup_lookup_result(opts->dedup, block, len, &bb->key[i],
+				&bb->result[i])) {
+		bb->cached[i] = 1;
+		bb->keyed[i] = 0;
+	} else {
+		libentropy_update_ctx(&bb->ctx[i], block, len);
+		bb->cached[i] = 0;
+		bb->keyed[i] = 1;
+	}
+
+	return batch_next(bb, offset, opts);
+}
+
+static int take_checkpoint(int fd, const struct entropy_opts *opts,
+			struct block_batch *bb, struct checkpoint *ckpt,
+			const struct entropy_ctx *ctx)
+{
+	int err;
+
+	/* Everything up to the checkpoint has to be in the output */
+	if (bb->count && batch_flush(bb, opts))
+		return -1;
+
+	err = checkpoint_sync_output(&ckpt->output_pos);
+	if (!err)
+		err = checkpoint_save(opts, fd, ckpt, ctx);
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to save checkpoint: %s\n",
+			__func__, __LINE__, strerror(-err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int resume_checkpoint(int fd, const struct entropy_opts *opts,
+			struct checkpoint *ckpt, struct entropy_ctx *ctx)
+{
+	int err;
+
+	err = checkpoint_load(opts, fd, ckpt, ctx);
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to resume from %s: %s\n",
+			__func__, __LINE__, opts->checkpoint_path,
+			(err == -ESTALE) ? "it is for a different scan" :
+			strerror(-err));
+		return -1;
+	}
+
+	err = checkpoint_rewind_output(ckpt->output_pos);
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to rewind the output: %s\n",
+			__func__, __LINE__, strerror(-err));
+		return -1;
+	}
+
+	if (lseek(fd, ckpt->offset, SEEK_SET) == -1) {
+		perror("Cannot seek in file");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int process_file(int fd, const struct entropy_opts *opts)
 {
+	const unsigned long long blocksize = opts->blocksize;
+	const unsigned long long size_limit = opts->size_limit;
+	const unsigned long long skip_offset = opts->skip_offset;
+	const libentropy_algo_t algo = opts->algo;
 	struct entropy_ctx ctx;
-	void *buf;
-	size_t bytes_read = 0;
-	size_t total_bytes_read = 0;
+	struct sparse_cursor sc;
+	struct pyramid pyr;
+	struct block_batch batch;
+	struct checkpoint ckpt;
+	struct direct_reader dr;
+	void *buf = NULL, *dst;
+	const char *data;
+	void *block = NULL;
+	ssize_t bytes_read = 0;
+	unsigned long long total_bytes_read = 0;
 	unsigned long long offset = 0;
 	unsigned long long remaining = 0;
 	unsigned long long read_size;
+	unsigned long long pos = 0, extent_len;
+	unsigned long long ckpt_bytes = 0;
+	unsigned long long read_chunk;
+	size_t pipe_size;
+	int in_hole, need_seek = 0;
+	double start;
 	libentropy_result_t result;
 	int err;
 	const long pagesize = sysconf(_SC_PAGESIZE);
 
+	/* Pipes are read a whole pipe buffer at a time, files a page */
+	pipe_size = pipe_setup(fd);
+	read_chunk = pipe_size ? pipe_size : (unsigned long long)pagesize;
+	if (opts->direct && pipe_size) {
+		fprintf(stderr, "Direct I/O needs a file or a device\n");
+		return -1;
+	}
+
 	/* Handle skip offset */
-	if (skip_offset) {
+	if (skip_offset && pipe_size) {
+		err = pipe_skip(fd, skip_offset, pipe_size);
+		if (err) {
+			fprintf(stderr, "Cannot skip in pipe: %s\n",
+				strerror(-err));
+			return -err;
+		}
+		offset = skip_offset;
+	} else if (skip_offset) {
 #if HAVE_LSEEK64
 		err = (int)lseek64(fd, skip_offset, SEEK_CUR);
 #else
@@ -291,9 +940,99 @@ static int process_file(int fd, unsigned long long blocksize,
 	posix_fadvise(fd, skip_offset, 0, POSIX_FADV_SEQUENTIAL);
 #endif
 
-	/* Process one page of data at a time */
-	buf = malloc(pagesize);
-	memset(&ctx, 0, sizeof(struct entropy_ctx));
+	/*
+	 * Holes in sparse files are accounted for without reading them,
+	 * for which we need to know where in the file we are
+	 */
+	sparse_init(&sc, fd);
+	if (sc.enabled || opts->direct)
+		pos = lseek(fd, 0, SEEK_CUR);
+
+	/* Direct I/O reads at pos, out of an aligned window */
+	dr.buf = NULL;
+	if (opts->direct) {
+		err = direct_init(&dr, fd, opts->throttle);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to use direct I/O:"
+				" %s\n", __func__, __LINE__, strerror(-err));
+			return -1;
+		}
+	}
+
+	err = libentropy_init_ctx(&ctx, opts->symbol);
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to init context: %d\n",
+			__func__, __LINE__, err);
+		direct_release(&dr);
+		return -1;
+	}
+	if (opts->nlevels) {
+		err = pyramid_init(&pyr, opts);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to init levels: %d\n",
+				__func__, __LINE__, err);
+			libentropy_release_ctx(&ctx);
+			direct_release(&dr);
+			return -1;
+		}
+	}
+	batch.ninit = batch.count = 0;
+	if (blocksize && !opts->nlevels) {
+		err = batch_init(&batch, opts->symbol);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to init batch: %d\n",
+				__func__, __LINE__, err);
+			libentropy_release_ctx(&ctx);
+			direct_release(&dr);
+			return -1;
+		}
+	}
+
+	/*
+	 * With the dedup cache, a block has to be hashed before we know
+	 * whether its frequencies need to be counted, so it is collected
+	 * in full first.
+	 */
+	if (opts->dedup) {
+		block = malloc(blocksize);
+		if (!block) {
+			err = errno;
+			perror("Unable to allocate mem for block");
+			goto out;
+		}
+	}
+
+	/* Process one chunk of data at a time */
+	buf = malloc(read_chunk);
+	if (!buf) {
+		err = errno;
+		perror("Unable to allocate mem for buffer");
+		goto out;
+	}
+
+	if (opts->checkpoint_path && opts->resume) {
+		if (resume_checkpoint(fd, opts, &ckpt, &ctx)) {
+			err = -1;
+			goto out;
+		}
+		pos = ckpt.pos;
+		offset = ckpt.offset;
+		total_bytes_read = ckpt.total_bytes_read;
+		remaining = ckpt.remaining;
+		ckpt_bytes = total_bytes_read;
+		sc.fd_moved = 0;
+	} else if (opts->checkpoint_path) {
+		/* The first one records where the output starts */
+		ckpt.pos = pos;
+		ckpt.offset = offset;
+		ckpt.total_bytes_read = 0;
+		ckpt.remaining = 0;
+		if (take_checkpoint(fd, opts, &batch, &ckpt, &ctx)) {
+			err = -1;
+			goto out;
+		}
+	}
+
 	do {
 		/* If we hit the file size limit, break out of loop */
 		if ((size_limit) && (total_bytes_read >= size_limit))
@@ -301,11 +1040,22 @@ static int process_file(int fd, unsigned long long blocksize,
 		/* Reset remaining at the start of each fresh block */
 		if (blocksize && !remaining)
 			remaining = blocksize;
-		/* Determine read size */
-		if ((blocksize) && (remaining < pagesize))
-			read_size = remaining;
+		/*
+		 * Determine read size
+		 *
+		 * Holes don't need to be read, so they aren't limited by
+		 * the chunk size. Data reads stop at the start of the next
+		 * hole.
+		 */
+		in_hole = sparse_next(&sc, pos, &extent_len);
+		if (in_hole)
+			read_size = extent_len;
+		else if (extent_len < read_chunk)
+			read_size = extent_len;
 		else
-			read_size = pagesize;
+			read_size = read_chunk;
+		if ((blocksize) && (remaining < read_size))
+			read_size = remaining;
 		/*
 		 * Take size limit into account
 		 *
@@ -315,70 +1065,212 @@ static int process_file(int fd, unsigned long long blocksize,
 		if ((size_limit) &&
 			((total_bytes_read + read_size) > size_limit))
 			read_size = size_limit - total_bytes_read;
-		/* Read data */
-		bytes_read = read(fd, buf, read_size);
+		/* Read data, or account for the hole */
+		dst = block ? ((char *)block + (blocksize - remaining)) : buf;
+		if (in_hole) {
+			if (block)
+				memset(dst, 0, read_size);
+			else
+				libentropy_update_ctx_zeros(&ctx, read_size);
+			bytes_read = read_size;
+			need_seek = 1;
+		} else {
+			if ((need_seek || sc.fd_moved) &&
+				(lseek(fd, pos, SEEK_SET) == -1)) {
+				err = errno;
+				perror("Cannot seek in file");
+				goto out;
+			}
+			need_seek = sc.fd_moved = 0;
+			if (opts->direct) {
+				/* Only refills of the window are throttled */
+				bytes_read = direct_read(&dr, pos, read_size,
+							&data);
+				if (bytes_read < 0) {
+					errno = -bytes_read;
+					bytes_read = -1;
+				} else if (block) {
+					memcpy(dst, data, bytes_read);
+				}
+			} else {
+				start = throttle_begin(opts->throttle,
+						read_size);
+				bytes_read = read(fd, dst, read_size);
+				throttle_end(opts->throttle, start);
+				data = dst;
+			}
+			if (bytes_read == -1) {
+				err = errno;
+				perror("Cannot read file");
+				goto out;
+			}
+			/* Update frequencies etc. */
+			if (!block)
+				libentropy_update_ctx(&ctx, data, bytes_read);
+		}
 		/* Get some bookkeeping done */
 		if (blocksize)
 			remaining -= bytes_read;
+		pos += bytes_read;
 		offset += bytes_read;
 		total_bytes_read += bytes_read;
 
-		/* Update frequencies etc. */
-		libentropy_update_ctx(&ctx, buf, bytes_read);
-
 		/*
 		 * If we are done with the block, calculate its entropy
 		 * and print it.
 		 */
-		if (blocksize && !remaining) {
-			result = libentropy_calculate(&ctx, algo, &err);
-			if (err == LIBENTROPY_STATUS_SUCCESS) {
-				print_result(result, algo, offset, 1, precision,
-					bfd_bin_size);
-				memset(&ctx, 0, sizeof(struct entropy_ctx));
-			} else {
-				fprintf(stderr, "%s():%d: %s: %d\n",
-					__func__, __LINE__,
-					"Entropy calculation failed",
-					err);
-				free(buf);
-				close(fd);
-				return -1;
+		if (blocksize && !remaining && block &&
+			!opts->dedup->histograms) {
+			if (batch_push_block(&batch, block, blocksize, offset,
+						opts)) {
+				err = -1;
+				goto out;
+			}
+		} else if (blocksize && !remaining) {
+			if (block)
+				dedup_update_ctx(opts->dedup, &ctx, block,
+						blocksize);
+			if (opts->nlevels) {
+				if (pyramid_push(&pyr, &ctx, offset, opts)) {
+					err = -1;
+					goto out;
+				}
+				libentropy_reset_ctx(&ctx);
+			} else if (batch_push(&batch, &ctx, offset, opts)) {
+				err = -1;
+				goto out;
 			}
 		}
+
+		/* Checkpoints are taken between blocks */
+		if (opts->checkpoint_path && (!blocksize || !remaining) &&
+			((total_bytes_read - ckpt_bytes) >=
+			 opts->checkpoint_interval)) {
+			ckpt.pos = pos;
+			ckpt.offset = offset;
+			ckpt.total_bytes_read = total_bytes_read;
+			ckpt.remaining = remaining;
+			if (take_checkpoint(fd, opts, &batch, &ckpt, &ctx)) {
+				err = -1;
+				goto out;
+			}
+			ckpt_bytes = total_bytes_read;
+		}
 	} while(bytes_read > 0);
-	free(buf);
 
 	/* Calculate entropy */
+	if (batch.count && batch_flush(&batch, opts)) {
+		err = -1;
+		goto out;
+	}
 	if (!blocksize) {
 		result = libentropy_calculate(&ctx, algo, &err);
 		if (err == LIBENTROPY_STATUS_SUCCESS)
-			print_result(result, algo, 0, 0, precision,
-				bfd_bin_size);
+			print_result(result, opts, NULL, 0, 0);
 	}
+	err = 0;
 
-	return 0;
+	/* The scan is complete, there is nothing left to resume */
+	if (opts->checkpoint_path)
+		unlink(opts->checkpoint_path);
+
+out:
+	/* Blocks completed before an error are still printed */
+	if (batch.count)
+		batch_flush(&batch, opts);
+	batch_release(&batch);
+	if (opts->nlevels)
+		pyramid_free(&pyr);
+	libentropy_release_ctx(&ctx);
+	direct_release(&dr);
+	free(block);
+	free(buf);
+	return err;
+}
+
+static int process_input(int fd, const struct entropy_opts *opts)
+{
+	switch (opts->index_mode) {
+	case ENTROPY_INDEX_BUILD:
+		return index_build(fd, opts);
+	case ENTROPY_INDEX_QUERY:
+		return index_query(fd, opts);
+	default:
+		return process_file(fd, opts);
+	}
 }
 
 int
 main(int argc, char *argv[])
 {
 	struct entropy_opts opts;
+	struct dedup_cache dedup;
+	struct throttle throttle;
 	unsigned i;
-	int err;
+	int fd, err, ret = 0;
 
 	err = parse_args(argc, argv, &opts);
 	if (err)
 		return err;
 
+	if (opts.dedup_budget) {
+		/* Histograms are only needed by bfd and to merge levels */
+		err = dedup_init(&dedup, opts.dedup_budget, opts.symbol,
+				opts.algo, (opts.algo == LIBENTROPY_ALGO_BFD) ||
+				opts.nlevels);
+		if (err) {
+			fprintf(stderr, "Unable to set up the dedup cache:"
+				" %s\n", strerror(-err));
+			return err;
+		}
+		opts.dedup = &dedup;
+	}
+
+	if (opts.max_bandwidth || opts.max_iops) {
+		err = throttle_init(&throttle, opts.max_bandwidth,
+				opts.max_iops, opts.target_latency);
+		if (err) {
+			fprintf(stderr, "Unable to set up the throttle: %s\n",
+				strerror(-err));
+			ret = err;
+			goto out;
+		}
+		opts.throttle = &throttle;
+	}
+
+	if (opts.recursive) {
+		ret = scan_tree(&opts);
+		goto out;
+	}
+
+	if (!opts.paths) {
+		ret = process_input(STDIN_FILENO, &opts);
+		goto out;
+	}
+
 	for (i = 0; i < opts.file_count; i++)
 	{
-		err = process_file(opts.fds[i], opts.blocksize, opts.size_limit,
-				opts.skip_offset, opts.algo, opts.precision,
-				opts.bfd_bin_size);
-		close(opts.fds[i]);
+		fd = open(opts.paths[i], O_RDONLY);
+		if (fd == -1) {
+			err = errno;
+			fprintf(stderr, "%s():%d: Unable to open file"
+				" %s: %s\n", __func__, __LINE__,
+				opts.paths[i], strerror(err));
+			ret = err;
+			continue;
+		}
+		err = process_input(fd, &opts);
+		if (err)
+			ret = err;
+		close(fd);
 	}
 
-	free(opts.fds);
-	return 0;
+out:
+	if (opts.throttle)
+		throttle_destroy(opts.throttle);
+	if (opts.dedup) {
+		dedup_report(opts.dedup);
+		dedup_free(opts.dedup);
+	}
+	return ret;
 }
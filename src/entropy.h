@@ -21,18 +21,189 @@
 #define  __ENTROPY_H__
 
 #include <libentropy.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ENTROPY_MAX_LEVELS	16
+
+/* Alignment and size of the reads in direct I/O mode */
+#define DIRECT_ALIGN		4096
+#define DIRECT_WINDOW_SIZE	(1 << 20)
 
 struct entropy_opts {
-	int *fds;
+	char * const *paths;
 	unsigned file_count;
 	unsigned long long blocksize;
 	unsigned long long size_limit;
 	unsigned long long skip_offset;
 	int precision;
 	libentropy_algo_t algo;
+	libentropy_symbol_t symbol;
+	/* Flags for libentropy_calculate_many() in block mode */
+	int calc_flags;
 
 	/* Options specific to Binary Frequency Distribution (bfd) */
 	unsigned char bfd_bin_size;
+
+	/* Options specific to recursive scanning */
+	int recursive;
+	unsigned threads;
+	unsigned long long split_size;
+
+	/* Block sizes of the multi-resolution map, smallest first */
+	unsigned long long levels[ENTROPY_MAX_LEVELS];
+	unsigned nlevels;
+
+	/* Options specific to the prefix histogram index */
+	enum {
+		ENTROPY_INDEX_NONE,
+		ENTROPY_INDEX_BUILD,
+		ENTROPY_INDEX_QUERY,
+	} index_mode;
+	const char *index_path;
+	unsigned long long granule;
+
+	/* Block deduplication cache, shared by all the files */
+	unsigned long long dedup_budget;
+	struct dedup_cache *dedup;
+
+	/* Options specific to checkpointing */
+	const char *checkpoint_path;
+	unsigned long long checkpoint_interval;
+	int resume;
+
+	/* I/O budget, shared by all the readers */
+	unsigned long long max_bandwidth;
+	unsigned long long max_iops;
+	unsigned long long target_latency;
+	struct throttle *throttle;
+
+	/* Bypass the page cache */
+	int direct;
 };
 
+struct pyramid_level {
+	unsigned long long blocksize;
+	unsigned long long ratio;	/* Blocks of the level below per block */
+	unsigned long long children;	/* Blocks merged into ctx so far */
+	struct entropy_ctx ctx;		/* Unused on level 0 */
+	char tag[24];
+};
+
+struct pyramid {
+	struct pyramid_level levels[ENTROPY_MAX_LEVELS];
+	unsigned nlevels;
+};
+
+struct dedup_entry;
+struct throttle;
+
+/* A block, as identified by the dedup cache */
+struct dedup_key {
+	uint64_t hash[2];
+	unsigned long long len;
+	libentropy_symbol_t symbol;
+	libentropy_algo_t algo;
+};
+
+struct dedup_cache {
+	void *entries;
+	size_t entry_size;
+	size_t capacity;
+	size_t used;
+	struct dedup_entry **buckets;
+	size_t nbuckets;
+	struct dedup_entry *head;	/* Most recently used */
+	struct dedup_entry *tail;	/* Least recently used */
+	unsigned long long lookups;
+	unsigned long long hits;
+	libentropy_symbol_t symbol;
+	libentropy_algo_t algo;
+	int histograms;		/* Entries keep the frequency table */
+};
+
+/* State of process_file() at a checkpoint */
+struct checkpoint {
+	unsigned long long pos;
+	unsigned long long offset;
+	unsigned long long total_bytes_read;
+	unsigned long long remaining;
+	long long output_pos;
+};
+
+extern unsigned long long parse_size(const char *str, int *err);
+
+extern int print_result(const libentropy_result_t result,
+			const struct entropy_opts *opts, const char *tag,
+			unsigned long long offset, int offset_flag);
+
+/* Aligned window of a file opened for direct I/O */
+struct direct_reader {
+	int fd;
+	char *buf;
+	unsigned long long start;	/* File offset of the window */
+	size_t len;			/* Valid bytes in the window */
+	struct throttle *throttle;
+};
+
+/* Position of a reader in the data and hole extents of a file */
+struct sparse_cursor {
+	int fd;
+	int enabled;
+	int in_hole;
+	int fd_moved;	/* The file offset was changed by a lookup */
+	unsigned long long extent_start;
+	unsigned long long extent_end;
+	unsigned long long size;
+};
+
+/* sparse.c */
+extern void sparse_init(struct sparse_cursor *sc, int fd);
+extern int sparse_next(struct sparse_cursor *sc, unsigned long long pos,
+		unsigned long long *len);
+
+/* direct.c */
+extern int direct_init(struct direct_reader *dr, int fd,
+		struct throttle *throttle);
+extern void direct_release(struct direct_reader *dr);
+extern ssize_t direct_read(struct direct_reader *dr, unsigned long long offset,
+		size_t len, const char **data);
+
+/* pipe.c */
+extern size_t pipe_setup(int fd);
+extern int pipe_skip(int fd, unsigned long long len, size_t chunk);
+
+/* pyramid.c */
+extern int pyramid_parse_levels(const char *str, struct entropy_opts *opts);
+extern int pyramid_init(struct pyramid *pyr, const struct entropy_opts *opts);
+extern void pyramid_free(struct pyramid *pyr);
+extern int pyramid_push(struct pyramid *pyr, const struct entropy_ctx *ctx,
+		unsigned long long offset, const struct entropy_opts *opts);
+
+/* index.c */
+extern int index_build(int fd, const struct entropy_opts *opts);
+extern int index_query(int fd, const struct entropy_opts *opts);
+
+/* dedup.c */
+extern int dedup_init(struct dedup_cache *dc, unsigned long long budget,
+		libentropy_symbol_t symbol, libentropy_algo_t algo,
+		int histograms);
+extern void dedup_free(struct dedup_cache *dc);
+extern int dedup_lookup_result(struct dedup_cache *dc, const void *buf,
+		size_t len, struct dedup_key *key, libentropy_result_t *result);
+extern void dedup_insert_result(struct dedup_cache *dc,
+		const struct dedup_key *key, libentropy_result_t result);
+extern void dedup_update_ctx(struct dedup_cache *dc, struct entropy_ctx *ctx,
+			const void *buf, size_t len);
+extern void dedup_report(const struct dedup_cache *dc);
+
+/* checkpoint.c */
+extern int checkpoint_save(const struct entropy_opts *opts, int fd,
+		const struct checkpoint *ckpt, const struct entropy_ctx *ctx);
+extern int checkpoint_load(const struct entropy_opts *opts, int fd,
+		struct checkpoint *ckpt, struct entropy_ctx *ctx);
+
+/* scan.c */
+extern int scan_tree(const struct entropy_opts *opts);
+
 #endif /*__ENTROPY_H__*/
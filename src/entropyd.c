@@ -0,0 +1,1090 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Entropy daemon
+ *
+ * Serves the requests of libentropyd clients over a Unix socket, so that
+ * measuring a lot of small objects doesn't cost a process each.
+ *
+ * Every connection has a reader thread that takes the requests off the
+ * socket and queues them for a shared pool of workers, with up to a
+ * number of requests in flight per connection. The inline data of the
+ * requests in flight is also limited across all connections: a reader
+ * leaves the payload in the socket until there is room for it.
+ *
+ * The workers queue their replies on the connection, and a writer thread
+ * per connection sends them. A client that is slow to read its replies
+ * only holds up its own reader, never the workers. The workers keep their
+ * contexts and read buffers for their whole lifetime, and the jobs are
+ * recycled along with the buffers that request data is received into.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "libentropy.h"
+#include "libentropyd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Size of the per-worker buffer for reading fd requests */
+#define ENTROPYD_READ_SIZE	(1 << 20)
+/* Request buffers larger than this are freed rather than recycled */
+#define ENTROPYD_KEEP_SIZE	(4 << 20)
+/* Number of idle jobs kept around for reuse */
+#define ENTROPYD_KEEP_JOBS	256
+/* Replies queued on a connection before its reader stops taking requests */
+#define ENTROPYD_REPLY_BACKLOG	(1 << 20)
+/* Number of replies sent at once by a writer */
+#define ENTROPYD_WRITE_BATCH	32
+
+struct entropyd_opts {
+	const char *socket_path;
+	unsigned threads;
+	unsigned long long max_length;
+	unsigned max_inflight;
+	unsigned long long max_bytes;
+};
+
+struct server;
+
+/* A reply waiting for the writer of its connection */
+struct reply {
+	struct reply *next;
+	struct entropyd_reply rp;
+	uint64_t bins[];	/* rp.rp_nbins frequencies for bfd */
+};
+
+struct conn {
+	struct server *srv;
+	int fd;
+	pthread_mutex_t lock;	/* Protects the fields below */
+	pthread_cond_t cond;	/* A request completed or a reply was sent */
+	pthread_cond_t write_cond;	/* A reply was queued or the reader left */
+	unsigned inflight;
+	unsigned refs;		/* The reader, the writer and the requests */
+	int reading;		/* The reader still takes requests */
+	int broken;		/* A reply couldn't be sent */
+	struct reply *replies;	/* Replies to send, oldest first */
+	struct reply *replies_tail;
+	size_t queued;		/* Bytes of the replies to send */
+};
+
+struct job {
+	struct job *next;
+	struct conn *conn;
+	struct entropyd_request rq;
+	int data_fd;
+	char *buf;
+	size_t cap;
+	size_t charged;		/* Bytes taken from the server's budget */
+};
+
+struct server {
+	const struct entropyd_opts *opts;
+
+	pthread_mutex_t lock;		/* Protects the fields below */
+	pthread_cond_t work_cond;	/* Work is available or we are done */
+	struct job *head;		/* Queued jobs, oldest first */
+	struct job *tail;
+	struct job *free_jobs;
+	unsigned nfree;
+	int done;
+
+	pthread_cond_t budget_cond;	/* Inline data was released */
+	unsigned long long inflight_bytes;
+};
+
+struct worker {
+	struct server *srv;
+	pthread_t thread;
+	/* One context for each libentropy_symbol_t */
+	struct entropy_ctx ctx[LIBENTROPY_SYMBOL_WORD + 1];
+	void *buf;
+};
+
+static volatile sig_atomic_t stop;
+
+static void usage(const char *pname)
+{
+	fprintf(stderr, "Usage: %s [-S socket path] [-j threads]"
+		" [-m max request size[=64M]] [-q max requests in flight"
+		" per connection[=64]] [-M max inline bytes in flight"
+		"[=256M]]\n"
+		"\t-S: Listen on socket path, %s by default\n"
+		"\t-j: Number of workers, one per CPU by default\n"
+		"\t-M: Data of the requests in flight, across all"
+		" connections\n",
+		pname, ENTROPYD_SOCKET_PATH);
+	exit(-1);
+}
+
+static unsigned long long parse_number(const char *str, const char *what,
+					const char *pname)
+{
+	unsigned long long val;
+	char *tmp;
+
+	val = strtoull(str, &tmp, 0);
+	if ((str[0] == '\0') || (*tmp != '\0') || !val) {
+		fprintf(stderr, "Invalid %s (%s)\n", what, str);
+		usage(pname);
+	}
+
+	return val;
+}
+
+static void parse_args(int argc, char * const argv[],
+		struct entropyd_opts *opts)
+{
+	int c;
+
+	opts->socket_path = ENTROPYD_SOCKET_PATH;
+	opts->threads = 0;
+	opts->max_length = 64 << 20;
+	opts->max_inflight = 64;
+	opts->max_bytes = 256 << 20;
+
+	while ((c = getopt(argc, argv, "hj:m:M:q:S:")) != -1) {
+		switch (c) {
+		case 'j':
+			opts->threads = parse_number(optarg, "number of"
+						" threads", argv[0]);
+			break;
+		case 'm':
+			opts->max_length = parse_number(optarg, "request size",
+							argv[0]);
+			break;
+		case 'M':
+			opts->max_bytes = parse_number(optarg, "number of"
+						" bytes", argv[0]);
+			break;
+		case 'q':
+			opts->max_inflight = parse_number(optarg, "number of"
+							" requests", argv[0]);
+			break;
+		case 'S':
+			opts->socket_path = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	/* Otherwise a request of the maximum size could never be admitted */
+	if (opts->max_length > opts->max_bytes) {
+		fprintf(stderr, "The request size can't be larger than the"
+			" bytes in flight\n");
+		usage(argv[0]);
+	}
+}
+
+static struct job *job_get(struct server *srv)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&srv->lock);
+	job = srv->free_jobs;
+	if (job) {
+		srv->free_jobs = job->next;
+		srv->nfree--;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	if (!job) {
+		job = calloc(1, sizeof(*job));
+		if (!job)
+			return NULL;
+	}
+	job->next = NULL;
+	job->conn = NULL;
+	job->data_fd = -1;
+	job->charged = 0;
+
+	return job;
+}
+
+static void job_put(struct server *srv, struct job *job)
+{
+	if (job->data_fd != -1)
+		close(job->data_fd);
+	job->data_fd = -1;
+	if (job->cap > ENTROPYD_KEEP_SIZE) {
+		free(job->buf);
+		job->buf = NULL;
+		job->cap = 0;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	if (job->charged) {
+		srv->inflight_bytes -= job->charged;
+		job->charged = 0;
+		pthread_cond_broadcast(&srv->budget_cond);
+	}
+	if (srv->nfree < ENTROPYD_KEEP_JOBS) {
+		job->next = srv->free_jobs;
+		srv->free_jobs = job;
+		srv->nfree++;
+		job = NULL;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	if (job) {
+		free(job->buf);
+		free(job);
+	}
+}
+
+/*
+ * Take the inline data of a request from the budget shared by all
+ * connections, waiting for other requests to complete if needed
+ *
+ * job_put() gives it back.
+ */
+static void job_charge(struct server *srv, struct job *job, size_t len)
+{
+	pthread_mutex_lock(&srv->lock);
+	while (srv->inflight_bytes + len > srv->opts->max_bytes)
+		pthread_cond_wait(&srv->budget_cond, &srv->lock);
+	srv->inflight_bytes += len;
+	job->charged = len;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static int job_reserve(struct job *job, size_t len)
+{
+	if (job->cap >= len)
+		return 0;
+
+	free(job->buf);
+	job->buf = malloc(len);
+	job->cap = job->buf ? len : 0;
+
+	return job->buf ? 0 : -ENOMEM;
+}
+
+static void job_submit(struct server *srv, struct job *job)
+{
+	pthread_mutex_lock(&srv->lock);
+	job->next = NULL;
+	if (srv->tail)
+		srv->tail->next = job;
+	else
+		srv->head = job;
+	srv->tail = job;
+	pthread_cond_signal(&srv->work_cond);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static void conn_put(struct conn *conn)
+{
+	unsigned refs;
+
+	pthread_mutex_lock(&conn->lock);
+	refs = --conn->refs;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (refs)
+		return;
+
+	close(conn->fd);
+	pthread_cond_destroy(&conn->write_cond);
+	pthread_cond_destroy(&conn->cond);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+static int send_full(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		while (iovcnt && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int recv_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(fd, buf, len, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -ECONNRESET;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static size_t reply_size(const struct reply *reply)
+{
+	return sizeof(*reply) + (reply->rp.rp_nbins * sizeof(uint64_t));
+}
+
+/*
+ * Give up on a connection, with conn->lock held
+ *
+ * Both the reader and the writer notice and leave.
+ */
+static void conn_break(struct conn *conn)
+{
+	conn->broken = 1;
+	shutdown(conn->fd, SHUT_RDWR);
+	pthread_cond_signal(&conn->cond);
+	pthread_cond_signal(&conn->write_cond);
+}
+
+/*
+ * Queue a reply for the writer, with the frequencies for bfd in bins if
+ * rp->rp_nbins is not 0
+ */
+static void conn_reply(struct conn *conn, const struct entropyd_reply *rp,
+		const void *bins)
+{
+	const size_t bins_len = rp->rp_nbins * sizeof(uint64_t);
+	struct reply *reply;
+
+	reply = malloc(sizeof(*reply) + bins_len);
+	if (reply) {
+		reply->next = NULL;
+		reply->rp = *rp;
+		if (bins_len)
+			memcpy(reply->bins, bins, bins_len);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	if (!reply) {
+		/* The client would wait for this reply forever */
+		conn_break(conn);
+	} else if (!conn->broken) {
+		if (conn->replies_tail)
+			conn->replies_tail->next = reply;
+		else
+			conn->replies = reply;
+		conn->replies_tail = reply;
+		conn->queued += reply_size(reply);
+		pthread_cond_signal(&conn->write_cond);
+		reply = NULL;
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	free(reply);
+}
+
+static void free_replies(struct reply *reply)
+{
+	struct reply *next;
+
+	for (; reply; reply = next) {
+		next = reply->next;
+		free(reply);
+	}
+}
+
+/*
+ * Send the replies of a connection as the workers queue them
+ *
+ * Leaves once the connection is broken, or once the reader is gone and
+ * every request it took has been replied to.
+ */
+static void *conn_write_main(void *arg)
+{
+	struct conn *conn = arg;
+	struct iovec iov[2 * ENTROPYD_WRITE_BATCH];
+	struct reply *batch, *last, *reply;
+	size_t bytes;
+	int i, iovcnt, err;
+
+	pthread_mutex_lock(&conn->lock);
+	for (;;) {
+		while (!conn->replies && !conn->broken &&
+			(conn->reading || conn->inflight))
+			pthread_cond_wait(&conn->write_cond, &conn->lock);
+		if (!conn->replies || conn->broken)
+			break;
+
+		/* Send what is queued with as few calls as possible */
+		batch = last = reply = conn->replies;
+		bytes = 0;
+		iovcnt = 0;
+		for (i = 0; reply && (i < ENTROPYD_WRITE_BATCH); i++) {
+			iov[iovcnt].iov_base = &reply->rp;
+			iov[iovcnt++].iov_len = sizeof(reply->rp);
+			if (reply->rp.rp_nbins) {
+				iov[iovcnt].iov_base = reply->bins;
+				iov[iovcnt++].iov_len = reply->rp.rp_nbins *
+					sizeof(uint64_t);
+			}
+			bytes += reply_size(reply);
+			last = reply;
+			reply = reply->next;
+		}
+		last->next = NULL;
+		conn->replies = reply;
+		if (!reply)
+			conn->replies_tail = NULL;
+		pthread_mutex_unlock(&conn->lock);
+
+		err = send_full(conn->fd, iov, iovcnt);
+		free_replies(batch);
+
+		pthread_mutex_lock(&conn->lock);
+		conn->queued -= bytes;
+		if (err)
+			conn_break(conn);
+		else
+			pthread_cond_signal(&conn->cond);
+	}
+
+	/* Nobody is going to read these */
+	reply = conn->replies;
+	conn->replies = conn->replies_tail = NULL;
+	conn->queued = 0;
+	pthread_mutex_unlock(&conn->lock);
+	free_replies(reply);
+
+	conn_put(conn);
+	return NULL;
+}
+
+static void conn_reply_error(struct conn *conn,
+			const struct entropyd_request *rq, int err)
+{
+	struct entropyd_reply rp;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.rp_magic = ENTROPYD_MAGIC;
+	rp.rp_status = err;
+	rp.rp_id = rq->rq_id;
+	conn_reply(conn, &rp, NULL);
+}
+
+/*
+ * Feed len bytes of fd from offset into ctx, or up to EOF if len is 0
+ *
+ * Pipes and sockets can't be read at an offset, they are read from
+ * wherever they are if the offset is 0.
+ */
+static int worker_read_fd(struct worker *worker, int fd,
+			unsigned long long offset, unsigned long long len,
+			struct entropy_ctx *ctx, unsigned long long *total)
+{
+	unsigned long long end = len ? (offset + len) : ULLONG_MAX;
+	const int at_start = !offset;
+	int seekable = 1;
+	size_t read_size;
+	ssize_t bytes_read;
+
+	*total = 0;
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+#endif
+	while (offset < end) {
+		read_size = ENTROPYD_READ_SIZE;
+		if (end - offset < read_size)
+			read_size = end - offset;
+		if (seekable)
+			bytes_read = pread(fd, worker->buf, read_size, offset);
+		else
+			bytes_read = read(fd, worker->buf, read_size);
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == ESPIPE) && seekable && at_start &&
+				!*total) {
+				seekable = 0;
+				continue;
+			}
+			return -errno;
+		}
+		if (!bytes_read)
+			break;
+		libentropy_update_ctx(ctx, worker->buf, bytes_read);
+		offset += bytes_read;
+		*total += bytes_read;
+	}
+
+	return 0;
+}
+
+static void worker_run(struct worker *worker, struct job *job)
+{
+	const struct entropyd_request *rq = &job->rq;
+	struct entropy_ctx *ctx = &worker->ctx[rq->rq_symbol];
+	struct entropyd_reply rp;
+	libentropy_result_t result;
+	const void *bins = NULL;
+	unsigned long long total;
+	unsigned i;
+	int err = 0, calc_err;
+
+	libentropy_reset_ctx(ctx);
+	if (rq->rq_type == ENTROPYD_REQ_DATA) {
+		libentropy_update_ctx(ctx, job->buf, rq->rq_length);
+		total = rq->rq_length;
+	} else {
+		err = worker_read_fd(worker, job->data_fd, rq->rq_offset,
+				rq->rq_length, ctx, &total);
+	}
+	if (err) {
+		conn_reply_error(job->conn, rq, err);
+		return;
+	}
+
+	memset(&rp, 0, sizeof(rp));
+	rp.rp_magic = ENTROPYD_MAGIC;
+	rp.rp_id = rq->rq_id;
+	rp.rp_length = total;
+	rp.rp_nmetrics = rq->rq_nmetrics;
+	for (i = 0; i < rq->rq_nmetrics; i++) {
+		result = libentropy_calculate(ctx, rq->rq_metrics[i],
+					&calc_err);
+		rp.rp_errors[i] = calc_err;
+		if (calc_err != LIBENTROPY_STATUS_SUCCESS)
+			continue;
+		if (rq->rq_metrics[i] == LIBENTROPY_ALGO_BFD)
+			bins = result.r_ptr;
+		else
+			rp.rp_values[i] = result.r_float;
+	}
+	if (bins)
+		rp.rp_nbins = libentropy_alphabet_size(ctx->ec_symbol);
+
+	conn_reply(job->conn, &rp, bins);
+}
+
+static void job_done(struct server *srv, struct job *job)
+{
+	struct conn *conn = job->conn;
+
+	pthread_mutex_lock(&conn->lock);
+	conn->inflight--;
+	pthread_cond_signal(&conn->cond);
+	/* The writer may be waiting for the last reply of a closed reader */
+	if (!conn->inflight)
+		pthread_cond_signal(&conn->write_cond);
+	pthread_mutex_unlock(&conn->lock);
+
+	job_put(srv, job);
+	conn_put(conn);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+	struct server *srv = worker->srv;
+	struct job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&srv->lock);
+		while (!srv->head && !srv->done)
+			pthread_cond_wait(&srv->work_cond, &srv->lock);
+		job = srv->head;
+		if (job) {
+			srv->head = job->next;
+			if (!srv->head)
+				srv->tail = NULL;
+		}
+		pthread_mutex_unlock(&srv->lock);
+		if (!job)
+			break;
+
+		worker_run(worker, job);
+		job_done(srv, job);
+	}
+
+	return NULL;
+}
+
+/*
+ * Receive the next request, along with the fd passed with it if any
+ *
+ * Returns 1 for a request, 0 if the client closed the connection between
+ * requests and -errno otherwise.
+ */
+static int recv_request(int fd, struct entropyd_request *rq, int *passed_fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct cmsghdr *c;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t done = 0;
+	ssize_t ret;
+	int err;
+
+	*passed_fd = -1;
+	while (done < sizeof(*rq)) {
+		iov.iov_base = (char *)rq + done;
+		iov.iov_len = sizeof(*rq) - done;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+		ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto fail;
+		}
+		if (!ret) {
+			err = done ? -ECONNRESET : 0;
+			goto fail;
+		}
+		/* Only one fd per request, the kernel closes any extras */
+		for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if ((c->cmsg_level != SOL_SOCKET) ||
+				(c->cmsg_type != SCM_RIGHTS) ||
+				(c->cmsg_len < CMSG_LEN(sizeof(int))))
+				continue;
+			if (*passed_fd != -1)
+				close(*passed_fd);
+			memcpy(passed_fd, CMSG_DATA(c), sizeof(int));
+		}
+		done += ret;
+	}
+
+	return 1;
+
+fail:
+	if (*passed_fd != -1)
+		close(*passed_fd);
+	*passed_fd = -1;
+	return err;
+}
+
+/*
+ * Check the framing of a request
+ *
+ * If this fails, there is no telling where the next request starts.
+ */
+static int check_frame(const struct entropyd_opts *opts,
+		const struct entropyd_request *rq)
+{
+	if ((rq->rq_magic != ENTROPYD_MAGIC) ||
+		(rq->rq_version != ENTROPYD_VERSION))
+		return -EPROTO;
+
+	switch (rq->rq_type) {
+	case ENTROPYD_REQ_DATA:
+		if (rq->rq_length > opts->max_length)
+			return -EMSGSIZE;
+		break;
+	case ENTROPYD_REQ_FD:
+		break;
+	default:
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+static int check_request(const struct entropyd_request *rq, int passed_fd)
+{
+	unsigned i;
+
+	if ((rq->rq_type == ENTROPYD_REQ_FD) && (passed_fd == -1))
+		return -EBADF;
+	if ((rq->rq_type == ENTROPYD_REQ_DATA) && (passed_fd != -1))
+		return -EINVAL;
+	if ((rq->rq_type == ENTROPYD_REQ_FD) &&
+		(rq->rq_offset + rq->rq_length < rq->rq_offset))
+		return -EINVAL;
+	if (rq->rq_symbol > LIBENTROPY_SYMBOL_WORD)
+		return -EINVAL;
+	if (!rq->rq_nmetrics || (rq->rq_nmetrics > ENTROPYD_MAX_METRICS))
+		return -EINVAL;
+	for (i = 0; i < rq->rq_nmetrics; i++)
+		if (rq->rq_metrics[i] > LIBENTROPY_ALGO_BFD)
+			return -EINVAL;
+
+	return 0;
+}
+
+static int start_thread(void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	return -err;
+}
+
+static void *conn_main(void *arg)
+{
+	struct conn *conn = arg;
+	struct server *srv = conn->srv;
+	struct entropyd_request rq;
+	struct job *job;
+	int passed_fd, broken, err;
+
+	err = start_thread(conn_write_main, conn);
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to start a writer: %s\n",
+			__func__, __LINE__, strerror(-err));
+		/* Drop the reference of the writer */
+		conn_put(conn);
+		goto out;
+	}
+
+	for (;;) {
+		/*
+		 * Don't take more requests than we are willing to queue,
+		 * nor while the client doesn't keep up with the replies
+		 */
+		pthread_mutex_lock(&conn->lock);
+		while (((conn->inflight >= srv->opts->max_inflight) ||
+			(conn->queued >= ENTROPYD_REPLY_BACKLOG)) &&
+			!conn->broken)
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		broken = conn->broken;
+		pthread_mutex_unlock(&conn->lock);
+		if (broken)
+			break;
+
+		err = recv_request(conn->fd, &rq, &passed_fd);
+		if (err <= 0)
+			break;
+
+		err = check_frame(srv->opts, &rq);
+		if (err) {
+			if (passed_fd != -1)
+				close(passed_fd);
+			conn_reply_error(conn, &rq, err);
+			break;
+		}
+
+		job = job_get(srv);
+		if (!job) {
+			if (passed_fd != -1)
+				close(passed_fd);
+			conn_reply_error(conn, &rq, -ENOMEM);
+			break;
+		}
+		job->rq = rq;
+		job->data_fd = passed_fd;
+		if (rq.rq_type == ENTROPYD_REQ_DATA) {
+			job_charge(srv, job, rq.rq_length);
+			err = job_reserve(job, rq.rq_length);
+			if (!err)
+				err = recv_full(conn->fd, job->buf,
+						rq.rq_length);
+			if (err) {
+				conn_reply_error(conn, &rq, err);
+				job_put(srv, job);
+				break;
+			}
+		}
+
+		err = check_request(&rq, passed_fd);
+		if (err) {
+			conn_reply_error(conn, &rq, err);
+			job_put(srv, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&conn->lock);
+		conn->inflight++;
+		conn->refs++;
+		pthread_mutex_unlock(&conn->lock);
+		job->conn = conn;
+		job_submit(srv, job);
+	}
+
+out:
+	pthread_mutex_lock(&conn->lock);
+	conn->reading = 0;
+	pthread_cond_signal(&conn->write_cond);
+	pthread_mutex_unlock(&conn->lock);
+	conn_put(conn);
+	return NULL;
+}
+
+static int conn_start(struct server *srv, int fd)
+{
+	struct conn *conn;
+	int err;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return -ENOMEM;
+	conn->srv = srv;
+	conn->fd = fd;
+	/* The reader starts the writer */
+	conn->refs = 2;
+	conn->reading = 1;
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->cond, NULL);
+	pthread_cond_init(&conn->write_cond, NULL);
+
+	err = start_thread(conn_main, conn);
+	if (err) {
+		pthread_cond_destroy(&conn->write_cond);
+		pthread_cond_destroy(&conn->cond);
+		pthread_mutex_destroy(&conn->lock);
+		free(conn);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Check whether a daemon is still listening on addr
+ */
+static int socket_in_use(const struct sockaddr_un *addr)
+{
+	int fd, ret;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return 1;
+	ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	if (ret == -1)
+		ret = (errno == ECONNREFUSED) ? 0 : 1;
+	else
+		ret = 1;
+	close(fd);
+
+	return ret;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err = -errno;
+		/* Take over the socket of a daemon that is gone */
+		if ((err != -EADDRINUSE) || socket_in_use(&addr) ||
+			unlink(path) ||
+			bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+			goto fail;
+	}
+	if (listen(fd, SOMAXCONN) == -1) {
+		err = -errno;
+		unlink(path);
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return err;
+}
+
+static void handle_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct entropyd_opts opts;
+	struct server srv;
+	struct worker *workers;
+	struct sigaction sa;
+	struct job *job, *next;
+	unsigned i, j, started = 0;
+	long ncpus;
+	int lfd, fd, err = 0;
+
+	parse_args(argc, argv, &opts);
+	if (!opts.threads) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opts.threads = (ncpus > 0) ? (unsigned)ncpus : 1;
+	}
+
+	memset(&srv, 0, sizeof(srv));
+	srv.opts = &opts;
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.work_cond, NULL);
+	pthread_cond_init(&srv.budget_cond, NULL);
+
+	workers = calloc(opts.threads, sizeof(*workers));
+	if (!workers) {
+		perror("Unable to allocate mem for workers");
+		return -1;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		workers[i].srv = &srv;
+		for (j = 0; j <= LIBENTROPY_SYMBOL_WORD; j++)
+			if (libentropy_init_ctx(&workers[i].ctx[j], j))
+				err = -ENOMEM;
+		workers[i].buf = malloc(ENTROPYD_READ_SIZE);
+		if (!workers[i].buf)
+			err = -ENOMEM;
+	}
+	if (err) {
+		fprintf(stderr, "%s():%d: Unable to allocate mem for"
+			" workers\n", __func__, __LINE__);
+		goto out_free;
+	}
+
+	lfd = listen_socket(opts.socket_path);
+	if (lfd < 0) {
+		err = lfd;
+		fprintf(stderr, "Unable to listen on %s: %s\n",
+			opts.socket_path, strerror(-err));
+		goto out_free;
+	}
+
+	/* No SA_RESTART, accept() has to be interrupted to stop */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	for (i = 0; i < opts.threads; i++) {
+		err = pthread_create(&workers[i].thread, NULL, worker_main,
+				&workers[i]);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to create worker:"
+				" %s\n", __func__, __LINE__, strerror(err));
+			err = -err;
+			goto out_stop;
+		}
+		started++;
+	}
+
+	while (!stop) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			/* Running out of fds or memory is hopefully temporary */
+			perror("Unable to accept a connection");
+			if ((errno == EMFILE) || (errno == ENFILE) ||
+				(errno == ENOBUFS) || (errno == ENOMEM)) {
+				sleep(1);
+				continue;
+			}
+			err = -errno;
+			break;
+		}
+		if (conn_start(&srv, fd)) {
+			fprintf(stderr, "%s():%d: Unable to start a"
+				" connection\n", __func__, __LINE__);
+			close(fd);
+		}
+	}
+
+out_stop:
+	close(lfd);
+	unlink(opts.socket_path);
+
+	/* Let the workers finish what is queued, the readers die with us */
+	pthread_mutex_lock(&srv.lock);
+	srv.done = 1;
+	pthread_cond_broadcast(&srv.work_cond);
+	pthread_mutex_unlock(&srv.lock);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* Readers that are still around free their jobs from now on */
+	pthread_mutex_lock(&srv.lock);
+	job = srv.free_jobs;
+	srv.free_jobs = NULL;
+	srv.nfree = ENTROPYD_KEEP_JOBS;
+	pthread_mutex_unlock(&srv.lock);
+	while (job) {
+		next = job->next;
+		free(job->buf);
+		free(job);
+		job = next;
+	}
+
+out_free:
+	for (i = 0; i < opts.threads; i++) {
+		for (j = 0; j <= LIBENTROPY_SYMBOL_WORD; j++)
+			libentropy_release_ctx(&workers[i].ctx[j]);
+		free(workers[i].buf);
+	}
+	free(workers);
+	return err;
+}
@@ -0,0 +1,458 @@
+/**
+ * Copyright 2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prefix histogram index
+ *
+ * The index stores P[k], the frequency table of the first k granules of
+ * the input, for every k. The frequency table of any granule aligned range
+ * [a, b) is then P[b] - P[a], which makes the cost of a query independent
+ * of the size of the range. Only the unaligned head and tail of a range are
+ * read from the data itself.
+ *
+ * To save space, the entries are stored in groups. The first entry of a
+ * group is a full 64-bit checkpoint, and the rest are stored as 16 or 32-bit
+ * deltas against that checkpoint. The group length is picked so that the
+ * deltas can't overflow. Looking up an entry is still O(1).
+ *
+ *   header | checkpoint, delta, delta, ... | checkpoint, delta, ... | ...
+ *
+ * The index is in host byte order and is meant to be mmap()ed as is.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "libentropy.h"
+#include "entropy.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define INDEX_MAGIC		"ENTIDX\0\0"
+#define INDEX_VERSION		1
+#define INDEX_READ_SIZE		(1 << 20)
+/* Upper bound on the group length, to keep checkpoints frequent */
+#define INDEX_MAX_GROUP		256
+
+struct index_header {
+	char ih_magic[8];
+	uint32_t ih_version;
+	uint32_t ih_delta_bytes;	/* Size of a delta counter, 2 or 4 */
+	uint64_t ih_granule;		/* Bytes per granule */
+	uint64_t ih_group;		/* Entries per group */
+	uint64_t ih_data_size;		/* Size of the indexed data */
+	uint64_t ih_entries;		/* Number of prefix entries */
+	int64_t ih_data_mtime;		/* To detect a stale index */
+	uint64_t ih_reserved[2];
+};
+
+struct index_map {
+	const struct index_header *hdr;
+	const unsigned char *base;
+	size_t len;
+	size_t group_size;		/* Size of a group in bytes */
+};
+
+static size_t index_group_size(uint64_t group, uint32_t delta_bytes)
+{
+	return (256 * sizeof(uint64_t)) + ((group - 1) * 256 * delta_bytes);
+}
+
+/*
+ * Pick the group length and the width of the deltas for a granule size
+ *
+ * A delta covers at most (group - 1) granules, so it can't get larger
+ * than (group - 1) * granule. Prefer 16-bit deltas when the groups can
+ * still be long enough to amortize the checkpoints.
+ */
+static void index_layout(uint64_t granule, uint64_t *group,
+			uint32_t *delta_bytes)
+{
+	uint64_t n;
+
+	n = (UINT16_MAX / granule) + 1;
+	if (n >= 8) {
+		*delta_bytes = sizeof(uint16_t);
+		*group = (n < INDEX_MAX_GROUP) ? n : INDEX_MAX_GROUP;
+		return;
+	}
+
+	n = (UINT32_MAX / granule) + 1;
+	*delta_bytes = sizeof(uint32_t);
+	*group = (n < INDEX_MAX_GROUP) ? n : INDEX_MAX_GROUP;
+}
+
+static int index_write_entry(FILE *out, const struct index_header *hdr,
+			uint64_t k, const unsigned long long cum[256],
+			unsigned long long ckpt[256])
+{
+	uint64_t entry[256];
+	uint32_t delta32[256];
+	uint16_t delta16[256];
+	const void *ptr;
+	size_t len;
+	unsigned i;
+
+	if (!(k % hdr->ih_group)) {
+		for (i = 0; i < 256; i++)
+			entry[i] = ckpt[i] = cum[i];
+		ptr = entry;
+		len = sizeof(entry);
+	} else if (hdr->ih_delta_bytes == sizeof(uint16_t)) {
+		for (i = 0; i < 256; i++)
+			delta16[i] = (uint16_t)(cum[i] - ckpt[i]);
+		ptr = delta16;
+		len = sizeof(delta16);
+	} else {
+		for (i = 0; i < 256; i++)
+			delta32[i] = (uint32_t)(cum[i] - ckpt[i]);
+		ptr = delta32;
+		len = sizeof(delta32);
+	}
+
+	if (fwrite(ptr, len, 1, out) != 1)
+		return -errno;
+	return 0;
+}
+
+int index_build(int fd, const struct entropy_opts *opts)
+{
+	struct index_header hdr;
+	struct entropy_ctx gctx;
+	struct sparse_cursor sc;
+	struct stat st;
+	unsigned long long cum[256], ckpt[256];
+	unsigned long long pos = 0, in_granule = 0, extent_len, len;
+	ssize_t bytes_read;
+	double start;
+	void *buf;
+	FILE *out;
+	unsigned i;
+	int need_seek = 0, err = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ih_magic, INDEX_MAGIC, sizeof(hdr.ih_magic));
+	hdr.ih_version = INDEX_VERSION;
+	hdr.ih_granule = opts->granule;
+	index_layout(hdr.ih_granule, &hdr.ih_group, &hdr.ih_delta_bytes);
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode))
+		hdr.ih_data_mtime = st.st_mtime;
+
+	buf = malloc(INDEX_READ_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	out = fopen(opts->index_path, "wb");
+	if (!out) {
+		err = -errno;
+		fprintf(stderr, "Unable to create index %s: %s\n",
+			opts->index_path, strerror(-err));
+		free(buf);
+		return err;
+	}
+
+	/* The header is rewritten once we know how much data there is */
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+		err = -errno;
+		goto out;
+	}
+
+	memset(cum, 0, sizeof(cum));
+	memset(&gctx, 0, sizeof(gctx));
+	err = index_write_entry(out, &hdr, 0, cum, ckpt);
+	hdr.ih_entries = 1;
+
+	sparse_init(&sc, fd);
+	if (sc.enabled)
+		pos = lseek(fd, 0, SEEK_CUR);
+	while (!err) {
+		len = hdr.ih_granule - in_granule;
+		if (sparse_next(&sc, pos, &extent_len)) {
+			if (extent_len < len)
+				len = extent_len;
+			libentropy_update_ctx_zeros(&gctx, len);
+			bytes_read = len;
+			need_seek = 1;
+		} else {
+			if (extent_len < len)
+				len = extent_len;
+			if (len > INDEX_READ_SIZE)
+				len = INDEX_READ_SIZE;
+			if ((need_seek || sc.fd_moved) &&
+				(lseek(fd, pos, SEEK_SET) == -1)) {
+				err = -errno;
+				break;
+			}
+			need_seek = sc.fd_moved = 0;
+			start = throttle_begin(opts->throttle, len);
+			bytes_read = read(fd, buf, len);
+			throttle_end(opts->throttle, start);
+			if (bytes_read == -1) {
+				if (errno == EINTR)
+					continue;
+				err = -errno;
+				break;
+			}
+			if (!bytes_read)
+				break;
+			libentropy_update_ctx(&gctx, buf, bytes_read);
+		}
+		pos += bytes_read;
+		in_granule += bytes_read;
+		hdr.ih_data_size += bytes_read;
+
+		if (in_granule == hdr.ih_granule) {
+			for (i = 0; i < 256; i++)
+				cum[i] += gctx.ec_freq_table[i];
+			err = index_write_entry(out, &hdr, hdr.ih_entries,
+						cum, ckpt);
+			hdr.ih_entries++;
+			memset(&gctx, 0, sizeof(gctx));
+			in_granule = 0;
+		}
+	}
+	if (err)
+		goto out;
+
+	if (fseek(out, 0, SEEK_SET) ||
+		(fwrite(&hdr, sizeof(hdr), 1, out) != 1))
+		err = -errno;
+
+out:
+	if (fclose(out) && !err)
+		err = -errno;
+	if (err)
+		fprintf(stderr, "Unable to build index %s: %s\n",
+			opts->index_path, strerror(-err));
+	free(buf);
+	return err;
+}
+
+static int index_open(struct index_map *idx, const char *path)
+{
+	const struct index_header *hdr;
+	struct stat st;
+	uint64_t ngroups;
+	void *base;
+	int fd, err;
+
+	memset(idx, 0, sizeof(*idx));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+	if (base == MAP_FAILED)
+		return err;
+
+	idx->base = base;
+	idx->len = st.st_size;
+	idx->hdr = hdr = base;
+	if (memcmp(hdr->ih_magic, INDEX_MAGIC, sizeof(hdr->ih_magic)) ||
+		(hdr->ih_version != INDEX_VERSION) ||
+		!hdr->ih_granule || !hdr->ih_group || !hdr->ih_entries ||
+		((hdr->ih_delta_bytes != sizeof(uint16_t)) &&
+		 (hdr->ih_delta_bytes != sizeof(uint32_t))))
+		goto invalid;
+
+	/* Make sure that every entry is within the mapping */
+	idx->group_size = index_group_size(hdr->ih_group,
+					hdr->ih_delta_bytes);
+	ngroups = (hdr->ih_entries - 1) / hdr->ih_group;
+	if (idx->len < sizeof(*hdr) + (ngroups * idx->group_size) +
+		(256 * sizeof(uint64_t)) +
+		(((hdr->ih_entries - 1) % hdr->ih_group) * 256 *
+		 hdr->ih_delta_bytes))
+		goto invalid;
+
+	return 0;
+
+invalid:
+	munmap((void *)idx->base, idx->len);
+	return -EINVAL;
+}
+
+static void index_close(struct index_map *idx)
+{
+	munmap((void *)idx->base, idx->len);
+}
+
+/*
+ * Fetch P[k], the frequency table of the first k granules
+ */
+static void index_get_prefix(const struct index_map *idx, uint64_t k,
+			unsigned long long freq[256])
+{
+	const unsigned char *group;
+	const uint64_t *ckpt;
+	const uint16_t *delta16;
+	const uint32_t *delta32;
+	uint64_t j = k % idx->hdr->ih_group;
+	unsigned i;
+
+	group = idx->base + sizeof(*idx->hdr) +
+		((k / idx->hdr->ih_group) * idx->group_size);
+	ckpt = (const uint64_t *)group;
+	for (i = 0; i < 256; i++)
+		freq[i] = ckpt[i];
+	if (!j)
+		return;
+
+	group += 256 * sizeof(uint64_t);
+	if (idx->hdr->ih_delta_bytes == sizeof(uint16_t)) {
+		delta16 = (const uint16_t *)group + ((j - 1) * 256);
+		for (i = 0; i < 256; i++)
+			freq[i] += delta16[i];
+	} else {
+		delta32 = (const uint32_t *)group + ((j - 1) * 256);
+		for (i = 0; i < 256; i++)
+			freq[i] += delta32[i];
+	}
+}
+
+static int index_read_range(int fd, struct entropy_ctx *ctx,
+			unsigned long long start, unsigned long long end,
+			struct throttle *throttle)
+{
+	double begin;
+	ssize_t bytes_read;
+	size_t len;
+	void *buf;
+	int err = 0;
+
+	if (start >= end)
+		return 0;
+
+	buf = malloc(INDEX_READ_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	while (start < end) {
+		len = INDEX_READ_SIZE;
+		if (end - start < len)
+			len = end - start;
+		begin = throttle_begin(throttle, len);
+		bytes_read = pread(fd, buf, len, start);
+		throttle_end(throttle, begin);
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		if (!bytes_read)
+			break;
+		libentropy_update_ctx(ctx, buf, bytes_read);
+		start += bytes_read;
+	}
+	free(buf);
+
+	return err;
+}
+
+/*
+ * Print the result for the range given by -s and -l, as if the data
+ * itself had been read
+ */
+int index_query(int fd, const struct entropy_opts *opts)
+{
+	struct index_map idx;
+	struct entropy_ctx ctx;
+	struct stat st;
+	libentropy_result_t result;
+	unsigned long long start, end, granule;
+	unsigned long long prefix[256];
+	uint64_t ka, kb;
+	unsigned i;
+	int err;
+
+	err = index_open(&idx, opts->index_path);
+	if (err) {
+		fprintf(stderr, "Unable to open index %s: %s\n",
+			opts->index_path, strerror(-err));
+		return err;
+	}
+	granule = idx.hdr->ih_granule;
+
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) &&
+		(((unsigned long long)st.st_size != idx.hdr->ih_data_size) ||
+		 (st.st_mtime != idx.hdr->ih_data_mtime)))
+		fprintf(stderr, "Warning: the data has changed since the"
+			" index %s was built\n", opts->index_path);
+
+	start = opts->skip_offset;
+	end = idx.hdr->ih_data_size;
+	if (opts->size_limit && (start + opts->size_limit < end))
+		end = start + opts->size_limit;
+	if (start > end)
+		start = end;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	/* Granule aligned part of the range that is covered by the index */
+	ka = (start + granule - 1) / granule;
+	kb = end / granule;
+	if (kb > idx.hdr->ih_entries - 1)
+		kb = idx.hdr->ih_entries - 1;
+	if (ka < kb) {
+		index_get_prefix(&idx, kb, ctx.ec_freq_table);
+		index_get_prefix(&idx, ka, prefix);
+		for (i = 0; i < 256; i++)
+			ctx.ec_freq_table[i] -= prefix[i];
+		ctx.ec_symbol_count = (kb - ka) * granule;
+		err = index_read_range(fd, &ctx, start, ka * granule,
+					opts->throttle);
+		if (!err)
+			err = index_read_range(fd, &ctx, kb * granule, end,
+						opts->throttle);
+	} else {
+		err = index_read_range(fd, &ctx, start, end, opts->throttle);
+	}
+	index_close(&idx);
+	if (err) {
+		fprintf(stderr, "Unable to read data: %s\n", strerror(-err));
+		return err;
+	}
+
+	result = libentropy_calculate(&ctx, opts->algo, &err);
+	if (err == LIBENTROPY_STATUS_SUCCESS)
+		print_result(result, opts, NULL, 0, 0);
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pipe input
+ *
+ * A pipe only holds 64K by default, so a reader that keeps up with the
+ * writer is woken up for every few pages that come in. Pipes are grown
+ * as far as we are allowed to, and read a whole pipe buffer at a time.
+ *
+ * Going further and mapping the pipe pages instead of reading them is
+ * not possible: vmsplice(2) from a pipe into user memory copies the data
+ * just like read(2) does.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "entropy.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* The default /proc/sys/fs/pipe-max-size */
+#define PIPE_MAX_SIZE		(1 << 20)
+
+/*
+ * Grow fd if it is a pipe
+ *
+ * Returns the size to read the pipe in, or 0 if fd is not a pipe.
+ */
+size_t pipe_setup(int fd)
+{
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	int size = 0;
+
+	if (fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+		return 0;
+
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	size = fcntl(fd, F_GETPIPE_SZ);
+	/* Unprivileged users can't go above pipe-max-size, try smaller */
+	if ((size != -1) && (size < PIPE_MAX_SIZE)) {
+		for (size = PIPE_MAX_SIZE; size > pagesize; size /= 2)
+			if (fcntl(fd, F_SETPIPE_SZ, size) != -1)
+				break;
+		size = fcntl(fd, F_GETPIPE_SZ);
+	}
+#endif
+
+	return (size > pagesize) ? (size_t)size : (size_t)pagesize;
+}
+
+/*
+ * Skip len bytes of a pipe
+ *
+ * Pipes can't seek, so the data is read and thrown away. Running into
+ * the end of the input is not an error, the same as seeking past EOF.
+ */
+int pipe_skip(int fd, unsigned long long len, size_t chunk)
+{
+	ssize_t bytes_read;
+	void *buf;
+	int err = 0;
+
+	buf = malloc(chunk);
+	if (!buf)
+		return -ENOMEM;
+
+	while (len) {
+		bytes_read = read(fd, buf, (len < chunk) ? len : chunk);
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		if (!bytes_read)
+			break;
+		len -= bytes_read;
+	}
+
+	free(buf);
+	return err;
+}
@@ -0,0 +1,171 @@
+/**
+ * Copyright 2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multi-resolution entropy map
+ *
+ * Only the smallest level is computed from the data. Every other level
+ * is built by merging the contexts of the blocks of the level below it,
+ * so all the levels come out of a single pass over the input. Each block
+ * size has to be a multiple of the one before it.
+ */
+
+#include "config.h"
+#include "libentropy.h"
+#include "entropy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Parse a comma separated list of block sizes in ascending order
+ */
+int pyramid_parse_levels(const char *str, struct entropy_opts *opts)
+{
+	char *list, *tok, *saveptr = NULL;
+	unsigned long long size;
+	int err = 0;
+
+	list = strdup(str);
+	if (!list)
+		return -ENOMEM;
+
+	opts->nlevels = 0;
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (opts->nlevels == ENTROPY_MAX_LEVELS) {
+			err = -E2BIG;
+			break;
+		}
+		size = parse_size(tok, &err);
+		if (err || !size) {
+			err = -EINVAL;
+			break;
+		}
+		/* Coarser levels must be made of whole finer blocks */
+		if (opts->nlevels &&
+			(size % opts->levels[opts->nlevels - 1] ||
+			 size == opts->levels[opts->nlevels - 1])) {
+			err = -EINVAL;
+			break;
+		}
+		opts->levels[opts->nlevels++] = size;
+	}
+	if (!err && !opts->nlevels)
+		err = -EINVAL;
+
+	free(list);
+	return err;
+}
+
+int pyramid_init(struct pyramid *pyr, const struct entropy_opts *opts)
+{
+	unsigned i;
+	int err;
+
+	memset(pyr, 0, sizeof(*pyr));
+	for (i = 0; i < opts->nlevels; i++) {
+		/* Level 0 is printed straight from the caller's context */
+		err = i ? libentropy_init_ctx(&pyr->levels[i].ctx,
+					opts->symbol) : 0;
+		if (err) {
+			pyramid_free(pyr);
+			return err;
+		}
+		pyr->nlevels++;
+		pyr->levels[i].blocksize = opts->levels[i];
+		pyr->levels[i].ratio = i ?
+			(opts->levels[i] / opts->levels[i - 1]) : 1;
+		snprintf(pyr->levels[i].tag, sizeof(pyr->levels[i].tag),
+			"%llu", opts->levels[i]);
+	}
+
+	return 0;
+}
+
+void pyramid_free(struct pyramid *pyr)
+{
+	unsigned i;
+
+	for (i = 1; i < pyr->nlevels; i++)
+		libentropy_release_ctx(&pyr->levels[i].ctx);
+	pyr->nlevels = 0;
+}
+
+static int pyramid_emit(const struct entropy_ctx *ctx, const char *tag,
+			unsigned long long offset,
+			const struct entropy_opts *opts)
+{
+	libentropy_result_t result;
+	int err;
+
+	result = libentropy_calculate(ctx, opts->algo, &err);
+	if (err != LIBENTROPY_STATUS_SUCCESS) {
+		fprintf(stderr, "%s():%d: %s: %d\n", __func__, __LINE__,
+			"Entropy calculation failed", err);
+		return -1;
+	}
+
+	return print_result(result, opts, tag, offset, 1);
+}
+
+/*
+ * Feed a completed block of the smallest level into the pyramid
+ *
+ * Prints the block itself and every coarser block that it completes. The
+ * offset is the end of the block, as in the regular block mode.
+ */
+int pyramid_push(struct pyramid *pyr, const struct entropy_ctx *ctx,
+		unsigned long long offset, const struct entropy_opts *opts)
+{
+	struct pyramid_level *lvl;
+	const struct entropy_ctx *child = ctx;
+	unsigned i;
+	int err;
+
+	err = pyramid_emit(ctx, pyr->levels[0].tag, offset, opts);
+	if (err)
+		return err;
+
+	for (i = 1; i < pyr->nlevels; i++) {
+		lvl = &pyr->levels[i];
+		err = libentropy_merge_ctx(&lvl->ctx, child);
+		if (err)
+			return err;
+		/* The child was complete, start over with the next one */
+		if (child != ctx)
+			libentropy_reset_ctx(&pyr->levels[i - 1].ctx);
+		if (++lvl->children < lvl->ratio)
+			return 0;
+
+		err = pyramid_emit(&lvl->ctx, lvl->tag, offset, opts);
+		if (err)
+			return err;
+		lvl->children = 0;
+		child = &lvl->ctx;
+	}
+
+	/* The topmost level has nobody to pass its context to */
+	if (child != ctx)
+		libentropy_reset_ctx(&pyr->levels[pyr->nlevels - 1].ctx);
+
+	return 0;
+}
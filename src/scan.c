@@ -0,0 +1,559 @@
+/**
+ * Copyright 2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Recursive directory scanner
+ *
+ * The main thread walks the directory trees with fts(3) and turns every
+ * regular file into one or more tasks. Each task covers a byte range of a
+ * file, so that a single huge file is spread across the workers instead
+ * of keeping one of them busy while the others sit idle.
+ *
+ * Tasks are handed out round-robin to per-worker deques. A worker pops
+ * from the tail of its own deque and, once that runs dry, steals from the
+ * head of the others. Files are only opened by the worker that processes
+ * a range, so the number of open fds is bounded by the number of workers
+ * rather than the size of the tree.
+ *
+ * The partial contexts of the ranges are merged into the context of their
+ * file, and whichever worker finishes the last range prints the result.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "libentropy.h"
+#include "entropy.h"
+#include "throttle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fts.h>
+#include <pthread.h>
+
+/* Size of the per-worker read buffer */
+#define SCAN_READ_SIZE		(1 << 20)
+/* Number of queued tasks per worker before the walker waits */
+#define SCAN_QUEUE_DEPTH	1024
+
+struct scan_file {
+	char *path;
+	struct entropy_ctx ctx;
+	pthread_mutex_t lock;
+	unsigned long long pending;	/* Ranges not yet processed */
+	int err;
+};
+
+struct scan_task {
+	struct scan_file *file;
+	unsigned long long start;
+	unsigned long long len;
+};
+
+/* Ring buffer of tasks, the owner uses the tail and thieves the head */
+struct scan_deque {
+	pthread_mutex_t lock;
+	struct scan_task *tasks;
+	size_t head;
+	size_t count;
+	size_t cap;
+};
+
+struct scan_pool;
+
+struct scan_worker {
+	struct scan_pool *pool;
+	struct scan_deque dq;
+	pthread_t thread;
+	unsigned id;
+	void *buf;
+};
+
+struct scan_pool {
+	const struct entropy_opts *opts;
+	struct scan_worker *workers;
+	unsigned nworkers;
+	unsigned next_worker;
+
+	pthread_mutex_t lock;		/* Protects the fields below */
+	pthread_cond_t work_cond;	/* Work is available or we are done */
+	pthread_cond_t space_cond;	/* Queues drained below the limit */
+	size_t queued;
+	size_t max_queued;
+	int done;
+	int err;			/* First error of a file */
+};
+
+static int deque_push(struct scan_deque *dq, const struct scan_task *task)
+{
+	struct scan_task *tasks;
+	size_t i, cap;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->cap) {
+		cap = dq->cap ? (dq->cap * 2) : 64;
+		tasks = malloc(cap * sizeof(*tasks));
+		if (!tasks) {
+			pthread_mutex_unlock(&dq->lock);
+			return -ENOMEM;
+		}
+		/* Unroll the ring into the new buffer */
+		for (i = 0; i < dq->count; i++)
+			tasks[i] = dq->tasks[(dq->head + i) % dq->cap];
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->head = 0;
+		dq->cap = cap;
+	}
+	dq->tasks[(dq->head + dq->count) % dq->cap] = *task;
+	dq->count++;
+	pthread_mutex_unlock(&dq->lock);
+
+	return 0;
+}
+
+static int deque_pop_tail(struct scan_deque *dq, struct scan_task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dq->count--;
+		*task = dq->tasks[(dq->head + dq->count) % dq->cap];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+static int deque_steal_head(struct scan_deque *dq, struct scan_task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		*task = dq->tasks[dq->head];
+		dq->head = (dq->head + 1) % dq->cap;
+		dq->count--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+static void scan_file_put(struct scan_pool *pool, struct scan_file *file,
+			const struct entropy_ctx *ctx, int err)
+{
+	const struct entropy_opts *opts = pool->opts;
+	libentropy_result_t result;
+	unsigned long long pending;
+	int calc_err;
+
+	pthread_mutex_lock(&file->lock);
+	/* Once a range failed, the result of the file is lost */
+	if (!file->err) {
+		if (err)
+			file->err = err;
+		else if (ctx)
+			file->err = -libentropy_merge_ctx(&file->ctx, ctx);
+	}
+	pending = --file->pending;
+	pthread_mutex_unlock(&file->lock);
+
+	/* Somebody else still has work to do on this file */
+	if (pending)
+		return;
+
+	if (!file->err) {
+		result = libentropy_calculate(&file->ctx, opts->algo,
+					&calc_err);
+		if (calc_err == LIBENTROPY_STATUS_SUCCESS)
+			print_result(result, opts, file->path, 0, 0);
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->err)
+			pool->err = file->err;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	pthread_mutex_destroy(&file->lock);
+	libentropy_release_ctx(&file->ctx);
+	free(file->path);
+	free(file);
+}
+
+static void scan_range(struct scan_worker *worker, const struct scan_task *task)
+{
+	struct scan_file *file = task->file;
+	struct entropy_ctx ctx;
+	struct sparse_cursor sc;
+	struct direct_reader dr;
+	const char *data;
+	unsigned long long offset = task->start;
+	unsigned long long end = task->start + task->len;
+	unsigned long long extent_len;
+	size_t read_size;
+	ssize_t bytes_read;
+	double start;
+	int fd, err = 0;
+
+	err = libentropy_init_ctx(&ctx, worker->pool->opts->symbol);
+	if (err) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	fd = open(file->path, O_RDONLY);
+	if (fd == -1) {
+		err = errno;
+		fprintf(stderr, "%s():%d: Unable to open file %s: %s\n",
+			__func__, __LINE__, file->path, strerror(err));
+		goto out;
+	}
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, task->start, task->len, POSIX_FADV_SEQUENTIAL);
+#endif
+	dr.buf = NULL;
+	if (worker->pool->opts->direct) {
+		err = -direct_init(&dr, fd, worker->pool->opts->throttle);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to use direct I/O on"
+				" %s: %s\n", __func__, __LINE__, file->path,
+				strerror(err));
+			close(fd);
+			goto out;
+		}
+	}
+
+	sparse_init(&sc, fd);
+	while (offset < end) {
+		if (sparse_next(&sc, offset, &extent_len)) {
+			if (end - offset < extent_len)
+				extent_len = end - offset;
+			libentropy_update_ctx_zeros(&ctx, extent_len);
+			offset += extent_len;
+			continue;
+		}
+		read_size = SCAN_READ_SIZE;
+		if (extent_len < read_size)
+			read_size = extent_len;
+		if (end - offset < read_size)
+			read_size = end - offset;
+		if (dr.buf) {
+			bytes_read = direct_read(&dr, offset, read_size,
+						&data);
+			if (bytes_read < 0) {
+				errno = -bytes_read;
+				bytes_read = -1;
+			}
+		} else {
+			start = throttle_begin(worker->pool->opts->throttle,
+					read_size);
+			bytes_read = pread(fd, worker->buf, read_size, offset);
+			throttle_end(worker->pool->opts->throttle, start);
+			data = worker->buf;
+		}
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			fprintf(stderr, "%s():%d: Unable to read file %s:"
+				" %s\n", __func__, __LINE__, file->path,
+				strerror(err));
+			break;
+		}
+		/* The file shrunk since we looked at it */
+		if (!bytes_read)
+			break;
+		libentropy_update_ctx(&ctx, data, bytes_read);
+		offset += bytes_read;
+	}
+	direct_release(&dr);
+	close(fd);
+
+out:
+	scan_file_put(worker->pool, file, &ctx, err);
+	libentropy_release_ctx(&ctx);
+}
+
+static int scan_get_task(struct scan_worker *worker, struct scan_task *task)
+{
+	struct scan_pool *pool = worker->pool;
+	unsigned i;
+
+	for (;;) {
+		/* Try our own queue first, then steal from the others */
+		if (deque_pop_tail(&worker->dq, task))
+			goto found;
+		for (i = 1; i < pool->nworkers; i++)
+			if (deque_steal_head(&pool->workers[(worker->id + i) %
+							pool->nworkers].dq,
+						task))
+				goto found;
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->queued && !pool->done)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (!pool->queued && pool->done) {
+			pthread_mutex_unlock(&pool->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+found:
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	if (pool->queued < pool->max_queued)
+		pthread_cond_signal(&pool->space_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 1;
+}
+
+static void *scan_worker_main(void *arg)
+{
+	struct scan_worker *worker = arg;
+	struct scan_task task;
+
+	while (scan_get_task(worker, &task))
+		scan_range(worker, &task);
+
+	return NULL;
+}
+
+static int scan_submit(struct scan_pool *pool, const struct scan_task *task)
+{
+	struct scan_worker *worker;
+	int err;
+
+	worker = &pool->workers[pool->next_worker];
+
+	/*
+	 * Push under the pool lock, so that the task is counted before a
+	 * thief that takes it can count it out
+	 */
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued >= pool->max_queued)
+		pthread_cond_wait(&pool->space_cond, &pool->lock);
+	err = deque_push(&worker->dq, task);
+	if (!err) {
+		pool->queued++;
+		pthread_cond_signal(&pool->work_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return err;
+}
+
+/*
+ * Split a file into ranges of at most split_size bytes and queue them
+ *
+ * All the ranges of a file go to the same worker, the idle workers will
+ * steal them from there.
+ */
+static int scan_submit_file(struct scan_pool *pool, const char *path,
+			unsigned long long size)
+{
+	const struct entropy_opts *opts = pool->opts;
+	struct scan_file *file;
+	struct scan_task task;
+	unsigned long long start, end, nranges, i;
+	int err;
+
+	start = opts->skip_offset;
+	end = size;
+	if (opts->size_limit && (start + opts->size_limit < end))
+		end = start + opts->size_limit;
+	if (start > end)
+		start = end;
+	/* Empty files still get a single (empty) range and a result */
+	nranges = (end - start + opts->split_size - 1) / opts->split_size;
+	if (!nranges)
+		nranges = 1;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -ENOMEM;
+	file->path = strdup(path);
+	if (!file->path ||
+		libentropy_init_ctx(&file->ctx, opts->symbol)) {
+		free(file->path);
+		free(file);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&file->lock, NULL);
+	file->pending = nranges;
+
+	task.file = file;
+	for (i = 0; i < nranges; i++) {
+		task.start = start + i * opts->split_size;
+		task.len = end - task.start;
+		if (task.len > opts->split_size)
+			task.len = opts->split_size;
+		err = scan_submit(pool, &task);
+		if (err) {
+			/* Drop the ranges that never made it to a queue */
+			for (; i < nranges; i++)
+				scan_file_put(pool, file, NULL, err);
+			return err;
+		}
+	}
+	pool->next_worker = (pool->next_worker + 1) % pool->nworkers;
+
+	return 0;
+}
+
+static int scan_walk(struct scan_pool *pool)
+{
+	const struct entropy_opts *opts = pool->opts;
+	FTS *fts;
+	FTSENT *ent;
+	int err = 0;
+
+	fts = fts_open(opts->paths, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_NOCHDIR,
+		NULL);
+	if (!fts) {
+		err = errno;
+		perror("Unable to walk the directory tree");
+		return err;
+	}
+
+	while ((ent = fts_read(fts))) {
+		switch (ent->fts_info) {
+		case FTS_F:
+			err = scan_submit_file(pool, ent->fts_path,
+					ent->fts_statp->st_size);
+			if (err) {
+				fprintf(stderr, "%s():%d: Unable to queue"
+					" file %s: %s\n", __func__, __LINE__,
+					ent->fts_path, strerror(-err));
+				goto out;
+			}
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			fprintf(stderr, "%s: %s\n", ent->fts_path,
+				strerror(ent->fts_errno));
+			err = ent->fts_errno;
+			break;
+		default:
+			/* Skip directories, symlinks and special files */
+			break;
+		}
+	}
+	if (errno)
+		err = errno;
+
+out:
+	fts_close(fts);
+	return err;
+}
+
+int scan_tree(const struct entropy_opts *opts)
+{
+	struct scan_pool pool;
+	unsigned i, started = 0;
+	long ncpus;
+	int err = 0, walk_err;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.opts = opts;
+	pool.nworkers = opts->threads;
+	if (!pool.nworkers) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		pool.nworkers = (ncpus > 0) ? (unsigned)ncpus : 1;
+	}
+	pool.max_queued = (size_t)pool.nworkers * SCAN_QUEUE_DEPTH;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work_cond, NULL);
+	pthread_cond_init(&pool.space_cond, NULL);
+
+	pool.workers = calloc(pool.nworkers, sizeof(*pool.workers));
+	if (!pool.workers) {
+		err = errno;
+		perror("Unable to allocate mem for workers");
+		goto out;
+	}
+
+	for (i = 0; i < pool.nworkers; i++) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		pthread_mutex_init(&pool.workers[i].dq.lock, NULL);
+		pool.workers[i].buf = malloc(SCAN_READ_SIZE);
+		if (!pool.workers[i].buf) {
+			err = ENOMEM;
+			perror("Unable to allocate mem for read buffer");
+			goto out_free;
+		}
+	}
+
+	for (i = 0; i < pool.nworkers; i++) {
+		err = pthread_create(&pool.workers[i].thread, NULL,
+				scan_worker_main, &pool.workers[i]);
+		if (err) {
+			fprintf(stderr, "%s():%d: Unable to create worker:"
+				" %s\n", __func__, __LINE__, strerror(err));
+			break;
+		}
+		started++;
+	}
+
+	if (started == pool.nworkers) {
+		walk_err = scan_walk(&pool);
+		if (walk_err)
+			err = walk_err;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.done = 1;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	/* Files that couldn't be read fail the scan too */
+	if (!err)
+		err = pool.err;
+
+out_free:
+	for (i = 0; i < pool.nworkers; i++) {
+		free(pool.workers[i].buf);
+		free(pool.workers[i].dq.tasks);
+		pthread_mutex_destroy(&pool.workers[i].dq.lock);
+	}
+	free(pool.workers);
+
+out:
+	pthread_cond_destroy(&pool.space_cond);
+	pthread_cond_destroy(&pool.work_cond);
+	pthread_mutex_destroy(&pool.lock);
+	return err;
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright 2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include "entropy.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+/*
+ * Prepare a cursor for walking the data and hole extents of fd
+ *
+ * Only regular files can have holes. For everything else, or if the
+ * platform lacks SEEK_DATA/SEEK_HOLE, the whole file is treated as data.
+ */
+void sparse_init(struct sparse_cursor *sc, int fd)
+{
+	struct stat st;
+
+	sc->fd = fd;
+	sc->enabled = 0;
+	sc->in_hole = 0;
+	sc->fd_moved = 0;
+	sc->extent_start = 0;
+	sc->extent_end = ULLONG_MAX;
+	sc->size = 0;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+		sc->enabled = 1;
+		sc->size = st.st_size;
+		/* Force a lookup on the first call */
+		sc->extent_end = 0;
+	}
+#else
+	(void)st;
+#endif
+}
+
+/*
+ * Find the extent that pos falls in
+ *
+ * Returns 1 if pos is in a hole and 0 if it is in data. In both cases, len
+ * is set to the number of bytes from pos until the end of the extent. Note
+ * that a lookup modifies the file offset of the fd and sets fd_moved, the
+ * caller is responsible for seeking back if it uses read(2).
+ */
+int sparse_next(struct sparse_cursor *sc, unsigned long long pos,
+		unsigned long long *len)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data, hole;
+
+	if (!sc->enabled)
+		goto all_data;
+	/* Reuse the last lookup if it still covers pos */
+	if ((pos >= sc->extent_start) && (pos < sc->extent_end))
+		goto out;
+
+	sc->extent_start = pos;
+	if (pos >= sc->size)
+		goto no_more_holes;
+
+	sc->fd_moved = 1;
+	data = lseek(sc->fd, pos, SEEK_DATA);
+	if (data == -1) {
+		/* ENXIO: there is no more data past pos, only a hole */
+		if (errno == ENXIO) {
+			sc->in_hole = 1;
+			sc->extent_end = sc->size;
+			goto out;
+		}
+		/* The file system doesn't know about holes */
+		sc->enabled = 0;
+		goto all_data;
+	}
+	if ((unsigned long long)data > pos) {
+		sc->in_hole = 1;
+		sc->extent_end = data;
+		goto out;
+	}
+
+	hole = lseek(sc->fd, pos, SEEK_HOLE);
+	if (hole == -1) {
+		sc->enabled = 0;
+		goto all_data;
+	}
+	sc->in_hole = 0;
+	/* The implicit hole at EOF is not a hole, the file may still grow */
+	if ((unsigned long long)hole >= sc->size)
+		goto no_more_holes;
+	sc->extent_end = hole;
+	goto out;
+
+no_more_holes:
+	sc->in_hole = 0;
+	sc->extent_end = ULLONG_MAX;
+out:
+	*len = sc->extent_end - pos;
+	return sc->in_hole;
+all_data:
+#endif
+	*len = ULLONG_MAX - pos;
+	return 0;
+}
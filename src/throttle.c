@@ -0,0 +1,178 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I/O budget for scans
+ *
+ * Both buckets are allowed to go into debt: a read takes its tokens right
+ * away and then sleeps until the bucket is back to 0. This keeps the
+ * average rate exact for reads of any size, and lets concurrent readers
+ * share a bucket without holding the lock while they sleep.
+ */
+
+#include "config.h"
+#include "throttle.h"
+
+#include <time.h>
+#include <errno.h>
+
+/* Tokens that can be saved up, in seconds worth of the rate */
+#define THROTTLE_BURST		0.05
+/* How often the adaptive mode changes the rates, in seconds */
+#define THROTTLE_ADJUST_PERIOD	0.1
+#define THROTTLE_MIN_SCALE	0.01
+
+static double throttle_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void throttle_sleep(double seconds)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) && (errno == EINTR))
+		;
+}
+
+/*
+ * Set up a throttle
+ *
+ * A limit of 0 means no limit. The adaptive mode is enabled by a non-zero
+ * target latency, and needs at least one of the limits to scale.
+ */
+int throttle_init(struct throttle *t, unsigned long long bps,
+		unsigned long long iops, unsigned long long target_latency_us)
+{
+	if (target_latency_us && !bps && !iops)
+		return -EINVAL;
+
+	t->bps = bps;
+	t->iops = iops;
+	t->byte_tokens = 0;
+	t->op_tokens = 0;
+	t->last_refill = throttle_now();
+	t->target_latency = target_latency_us / 1e6;
+	t->latency = 0;
+	t->scale = 1.0;
+	t->last_adjust = t->last_refill;
+
+	return -pthread_mutex_init(&t->lock, NULL);
+}
+
+void throttle_destroy(struct throttle *t)
+{
+	pthread_mutex_destroy(&t->lock);
+}
+
+static void throttle_refill(struct throttle *t, double now)
+{
+	const double elapsed = now - t->last_refill;
+	double cap;
+
+	t->last_refill = now;
+	if (t->bps) {
+		cap = t->bps * t->scale * THROTTLE_BURST;
+		t->byte_tokens += elapsed * t->bps * t->scale;
+		if (t->byte_tokens > cap)
+			t->byte_tokens = cap;
+	}
+	if (t->iops) {
+		cap = t->iops * t->scale * THROTTLE_BURST;
+		/* Always allow a read to go through at once */
+		if (cap < 1)
+			cap = 1;
+		t->op_tokens += elapsed * t->iops * t->scale;
+		if (t->op_tokens > cap)
+			t->op_tokens = cap;
+	}
+}
+
+/*
+ * Wait until a read of bytes fits in the budget
+ *
+ * Returns the time the read is started at, to be passed to throttle_end()
+ * once it completes. A NULL throttle does nothing.
+ */
+double throttle_begin(struct throttle *t, unsigned long long bytes)
+{
+	double wait = 0, w;
+
+	if (!t)
+		return 0;
+
+	pthread_mutex_lock(&t->lock);
+	throttle_refill(t, throttle_now());
+	if (t->bps) {
+		t->byte_tokens -= bytes;
+		if (t->byte_tokens < 0)
+			wait = -t->byte_tokens / (t->bps * t->scale);
+	}
+	if (t->iops) {
+		t->op_tokens -= 1;
+		w = -t->op_tokens / (t->iops * t->scale);
+		if (w > wait)
+			wait = w;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (wait > 0)
+		throttle_sleep(wait);
+
+	return throttle_now();
+}
+
+/*
+ * Account for the latency of a completed read
+ *
+ * The rates are halved when the average latency is above the target and
+ * raised in small steps when it isn't, at most once per period.
+ */
+void throttle_end(struct throttle *t, double start)
+{
+	const double now = throttle_now();
+	const double latency = now - start;
+
+	if (!t || !t->target_latency)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	/* Same weight as TCP gives to a new RTT sample */
+	t->latency = t->latency ? ((0.875 * t->latency) + (0.125 * latency)) :
+		latency;
+	if ((now - t->last_adjust) >= THROTTLE_ADJUST_PERIOD) {
+		if (t->latency > t->target_latency) {
+			t->scale /= 2;
+			if (t->scale < THROTTLE_MIN_SCALE)
+				t->scale = THROTTLE_MIN_SCALE;
+		} else if (t->scale < 1.0) {
+			t->scale += 0.05;
+			if (t->scale > 1.0)
+				t->scale = 1.0;
+		}
+		t->last_adjust = now;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,54 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef  __THROTTLE_H__
+#define  __THROTTLE_H__
+
+#include <pthread.h>
+
+/*
+ * Token buckets limiting the bandwidth and the IOPS of a scan
+ *
+ * In the adaptive mode, the limits are only upper bounds. The rates in
+ * effect are scaled down when the read latency goes above the target,
+ * and back up when it recovers.
+ */
+struct throttle {
+	double bps;		/* Bytes per second, 0 for no limit */
+	double iops;		/* Reads per second, 0 for no limit */
+	double byte_tokens;
+	double op_tokens;
+	double last_refill;
+
+	double target_latency;	/* In seconds, 0 if not adaptive */
+	double latency;		/* Moving average of the read latency */
+	double scale;		/* Share of the limits in effect */
+	double last_adjust;
+
+	pthread_mutex_t lock;
+};
+
+extern int throttle_init(struct throttle *t, unsigned long long bps,
+			unsigned long long iops,
+			unsigned long long target_latency_us);
+extern void throttle_destroy(struct throttle *t);
+extern double throttle_begin(struct throttle *t, unsigned long long bytes);
+extern void throttle_end(struct throttle *t, double start);
+
+#endif /*__THROTTLE_H__*/
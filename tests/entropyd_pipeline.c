@@ -0,0 +1,111 @@
+/**
+ * Copyright 2015,2017 Gokturk Yuksek
+ *
+ * This file is part of libentropy.
+ *
+ * libentropy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libentropy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with libentropy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pipelining against entropyd
+ *
+ * A client that sends a lot of requests before it reads any of the
+ * replies must not stall the daemon, neither for itself nor for the
+ * other connections. The alarm fails the test if anything hangs.
+ */
+
+#include "config.h"
+#include "libentropy.h"
+#include "libentropyd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NREQUESTS	2000
+#define REQUEST_SIZE	16
+#define TIMEOUT		30
+
+int main(int argc, char *argv[])
+{
+	struct entropyd_client pipelined, other;
+	struct entropyd_query query;
+	struct entropyd_result res;
+	unsigned char buf[REQUEST_SIZE];
+	unsigned long long id_sum = 0;
+	unsigned i;
+	int err;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+		return 2;
+	}
+	alarm(TIMEOUT);
+
+	memset(&query, 0, sizeof(query));
+	query.symbol = LIBENTROPY_SYMBOL_BYTE;
+	query.nmetrics = 1;
+	query.metrics[0] = LIBENTROPY_ALGO_SHANNON;
+
+	err = entropyd_connect(&pipelined, argv[1]);
+	if (!err)
+		err = entropyd_connect(&other, argv[1]);
+	if (err) {
+		fprintf(stderr, "Unable to connect: %s\n", strerror(-err));
+		return 1;
+	}
+
+	/* Every byte is distinct, so each request has 4 bits of entropy */
+	for (i = 0; i < REQUEST_SIZE; i++)
+		buf[i] = i;
+	for (i = 0; i < NREQUESTS; i++) {
+		err = entropyd_send_data(&pipelined, &query, buf, sizeof(buf),
+					NULL);
+		if (err) {
+			fprintf(stderr, "Unable to send request %u: %s\n", i,
+				strerror(-err));
+			return 1;
+		}
+	}
+
+	/* The pipelined client hasn't read anything yet */
+	err = entropyd_query_data(&other, &query, "aabb", 4, &res);
+	if (err || res.status || (res.values[0] != 1.0)) {
+		fprintf(stderr, "Other connection: err %d status %d\n", err,
+			res.status);
+		return 1;
+	}
+	entropyd_release_result(&res);
+
+	for (i = 0; i < NREQUESTS; i++) {
+		err = entropyd_recv(&pipelined, &res);
+		if (err || res.status || (res.length != REQUEST_SIZE) ||
+			(res.values[0] != 4.0)) {
+			fprintf(stderr, "Reply %u: err %d status %d\n", i, err,
+				res.status);
+			return 1;
+		}
+		id_sum += res.id;
+		entropyd_release_result(&res);
+	}
+	if (id_sum != (unsigned long long)NREQUESTS * (NREQUESTS - 1) / 2) {
+		fprintf(stderr, "Replies don't match the requests\n");
+		return 1;
+	}
+
+	entropyd_disconnect(&pipelined);
+	entropyd_disconnect(&other);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Run entropyd_pipeline against a daemon of our own with two workers
+
+sock=$(mktemp -u "${TMPDIR:-/tmp}/entropyd-test.XXXXXX")
+
+"${ENTROPYD:-../src/entropyd}" -S "$sock" -j 2 &
+pid=$!
+
+i=0
+while [ ! -S "$sock" ] && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+./entropyd_pipeline "$sock"
+ret=$?
+
+kill $pid
+wait $pid 2>/dev/null
+rm -f "$sock"
+exit $ret